@@ -0,0 +1,101 @@
+/* arena.c */
+/* chunked bump allocator, see arena.h */
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "arena.h"
+
+/* the chunks get bigger as the arena grows, up to this size */
+#define MIN_CHUNK (64 * 1024)
+#define MAX_CHUNK (8 * 1024 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+	char data[];
+};
+
+static size_t align(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t chunk_size = arena->chunks ? arena->chunks->size * 2 : MIN_CHUNK;
+
+	if (chunk_size > MAX_CHUNK)
+		chunk_size = MAX_CHUNK;
+	if (chunk_size < size)
+		chunk_size = size;
+	/* the data has to start aligned, too */
+	chunk = malloc(align(sizeof(*chunk)) + chunk_size);
+	if (!chunk)
+		exit(1);
+	chunk->used = align(sizeof(*chunk)) - sizeof(*chunk);
+	chunk->size = chunk->used + chunk_size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = align(size);
+	if (!chunk || chunk->size - chunk->used < size)
+		chunk = new_chunk(arena, size);
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	arena->last = ptr;
+	return ptr;
+}
+
+void *arena_grow(struct arena *arena, void *ptr, size_t oldsize, size_t newsize)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *newptr;
+
+	/* the last allocation just takes more of its chunk, if there is room */
+	if (ptr && ptr == arena->last) {
+		size_t start = (char *) ptr - chunk->data;
+
+		if (chunk->size - start >= align(newsize)) {
+			chunk->used = start + align(newsize);
+			return ptr;
+		}
+	}
+	newptr = arena_alloc(arena, newsize);
+	if (ptr)
+		memcpy(newptr, ptr, oldsize < newsize ? oldsize : newsize);
+	return newptr;
+}
+
+gboolean arena_owns(const struct arena *arena, const void *ptr)
+{
+	const struct arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+		if ((const char *) ptr >= chunk->data && (const char *) ptr < chunk->data + chunk->size)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void arena_free_all(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks;
+
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+	arena->last = NULL;
+}
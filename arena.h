@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * A simple bump allocator: memory comes out of big chunks and is
+ * only given back all at once. The most recent allocation can grow
+ * in place, which is what the sample arrays want while a dive is
+ * being read.
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+	void *last;
+};
+
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern void *arena_grow(struct arena *arena, void *ptr, size_t oldsize, size_t newsize);
+extern gboolean arena_owns(const struct arena *arena, const void *ptr);
+extern void arena_free_all(struct arena *arena);
+
+#endif
@@ -0,0 +1,420 @@
+/* bench.c */
+/* micro-benchmarks for the core data paths
+ *
+ * Times the parser, the fixup and merge logic, the profile and deco
+ * calculations, the planner, the XML writer and the statistics over
+ * the dive files given on the command line and over a synthetic
+ * logbook. There is no UI in this binary - the hooks the core calls
+ * into the UI are stubbed out in nogui.c.
+ *
+ * The output is one tab separated line per benchmark:
+ *
+ *   corpus  benchmark  ops  seconds  ops/sec  allocs/op  bytes/op
+ *
+ * where an "op" is one call of the function that is benchmarked.
+ * Allocations are only counted when the binary was linked with
+ * the malloc wrappers (see the bench target in the Makefile), and
+ * only those subsurface asks for itself: what glib, libxml2 and
+ * libxslt allocate inside their own calls isn't counted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "dive.h"
+#include "divelist.h"
+#include "display.h"
+#include "file.h"
+#include "planner.h"
+#include "statistics.h"
+#include "synthetic.h"
+#include "uemis.h"
+
+#ifdef BENCH_COUNT_ALLOCS
+/* linked with -Wl,--wrap=malloc etc, so this sees the allocations done by subsurface itself */
+static unsigned long alloc_count, alloc_bytes;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+extern char *__real_strdup(const char *s);
+extern char *__real_strndup(const char *s, size_t n);
+
+void *__wrap_malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	alloc_count++;
+	alloc_bytes += strlen(s) + 1;
+	return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n)
+{
+	alloc_count++;
+	alloc_bytes += strnlen(s, n) + 1;
+	return __real_strndup(s, n);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long alloc_count, alloc_bytes;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+struct corpus {
+	const char *name;
+	int nr;
+	struct memblock *files;
+	char **filenames;
+};
+
+struct benchmark {
+	const char *name;
+	/* untimed, run before/after each timed iteration */
+	void (*setup)(struct corpus *corpus);
+	void (*teardown)(struct corpus *corpus);
+	/* timed, returns the number of ops it did */
+	int (*run)(struct corpus *corpus);
+};
+
+static double min_time = 0.5;
+static char *save_filename;
+
+static void clear_dive_table(void)
+{
+	while (dive_table.nr)
+		delete_single_dive(dive_table.nr - 1);
+	dive_table.preexisting = 0;
+	free_import_arenas();
+}
+
+/* the same as parse_file(), without the file system */
+static void load_corpus(struct corpus *corpus)
+{
+	int i;
+
+	begin_import();
+	for (i = 0; i < corpus->nr; i++) {
+		GError *error = NULL;
+
+		parse_xml_buffer(corpus->filenames[i], corpus->files[i].buffer,
+				 corpus->files[i].size, &dive_table, &error);
+		if (error)
+			g_error_free(error);
+	}
+	end_import();
+}
+
+static void load_and_report(struct corpus *corpus)
+{
+	load_corpus(corpus);
+	report_dives(FALSE, FALSE);
+}
+
+static void unload_corpus(struct corpus *corpus)
+{
+	clear_dive_table();
+}
+
+static int run_parse(struct corpus *corpus)
+{
+	load_corpus(corpus);
+	return corpus->nr;
+}
+
+static int run_fixup(struct corpus *corpus)
+{
+	int i;
+	struct dive *dive;
+
+	for_each_dive(i, dive)
+		fixup_dive(dive);
+	return dive_table.nr;
+}
+
+/* every dive twice, so report_dives() has something to merge */
+static void load_twice(struct corpus *corpus)
+{
+	load_corpus(corpus);
+	report_dives(FALSE, FALSE);
+	load_corpus(corpus);
+}
+
+static int run_report(struct corpus *corpus)
+{
+	report_dives(FALSE, FALSE);
+	return 1;
+}
+
+static int run_plot_info(struct corpus *corpus)
+{
+	int i;
+	struct dive *dive;
+	struct plot_info pi;
+
+	for_each_dive(i, dive) {
+		calculate_max_limits(dive, &dive->dc, &pi);
+		create_plot_info(dive, &dive->dc, &pi);
+		free_plot_info(&pi);
+	}
+	return dive_table.nr;
+}
+
+static int run_init_decompression(struct corpus *corpus)
+{
+	int i;
+	struct dive *dive;
+
+	for_each_dive(i, dive)
+		init_decompression(dive);
+	return dive_table.nr;
+}
+
+/* 30 minutes at 45m on 21/35 with a switch to EAN50 at 21m */
+static int run_plan(struct corpus *corpus)
+{
+	struct diveplan diveplan = {};
+	struct dive *dive = NULL;
+	char *cache_data = NULL, *error_string = NULL;
+
+	diveplan.surface_pressure = SURFACE_PRESSURE;
+	add_duration_to_nth_dp(&diveplan, 0, 3 * 60, FALSE);
+	add_depth_to_nth_dp(&diveplan, 0, 45000);
+	add_gas_to_nth_dp(&diveplan, 0, 210, 350);
+	add_duration_to_nth_dp(&diveplan, 1, 30 * 60, FALSE);
+	add_depth_to_nth_dp(&diveplan, 1, 45000);
+	add_gas_to_nth_dp(&diveplan, 1, 210, 350);
+	/* a duration of zero just makes the gas available */
+	add_depth_to_nth_dp(&diveplan, 2, 21000);
+	add_gas_to_nth_dp(&diveplan, 2, 500, 0);
+	plan(&diveplan, &cache_data, &dive, &error_string);
+	free_dps(diveplan.dp);
+	free(cache_data);
+	clear_dive_table();
+	return 1;
+}
+
+static int run_save(struct corpus *corpus)
+{
+	save_dives(save_filename);
+	return 1;
+}
+
+static int run_statistics(struct corpus *corpus)
+{
+	struct dive *prev_dive;
+
+	process_all_dives(NULL, &prev_dive);
+	return 1;
+}
+
+/*
+ * A Uemis divelog blob with a sample every second for 18 hours, which
+ * is some 3MB of base64 - what the downloader hands to the parser, only
+ * much bigger. The same for every corpus, so it's only created once.
+ */
+#define UEMIS_SAMPLES 65000
+
+static char *uemis_blob;
+
+static void create_uemis_blob(struct corpus *corpus)
+{
+	int i, len = 0x123 + UEMIS_SAMPLES * sizeof(uemis_sample_t);
+	uint8_t *data;
+	uemis_sample_t *u_sample;
+
+	if (uemis_blob)
+		return;
+	data = calloc(1, len);
+	memcpy(data, "Dive\1\0\0", 7);
+	*(uint16_t *)(data + 43) = 1013;	/* surface pressure */
+	*(uint16_t *)(data + 45) = 25;		/* air temperature */
+	data[19] = 1;				/* salt water */
+	u_sample = (uemis_sample_t *)(data + 0x123);
+	for (i = 0; i < UEMIS_SAMPLES; i++, u_sample++) {
+		int pressure = 20000 - i / 4;
+
+		u_sample->dive_time = i + 1;
+		u_sample->water_pressure = 300 + i % 3000;
+		u_sample->dive_temperature = 150 + i % 50;
+		u_sample->tank_pressure_low = pressure & 0xff;
+		u_sample->tank_pressure_high = pressure >> 8;
+		u_sample->cns = i / 1000;
+	}
+	uemis_blob = g_base64_encode(data, len);
+	free(data);
+}
+
+static int run_uemis(struct corpus *corpus)
+{
+	struct dive *dive = alloc_dive();
+
+	dive->dc.duration.seconds = UEMIS_SAMPLES;
+	uemis_parse_divelog_binary(uemis_blob, dive);
+	record_dive(dive);
+	return 1;
+}
+
+static const struct benchmark benchmarks[] = {
+	{ "parse_xml_buffer", NULL, unload_corpus, run_parse },
+	{ "fixup_dive", load_corpus, unload_corpus, run_fixup },
+	{ "report_dives", load_twice, unload_corpus, run_report },
+	{ "create_plot_info", load_and_report, unload_corpus, run_plot_info },
+	{ "init_decompression", load_and_report, unload_corpus, run_init_decompression },
+	{ "plan", NULL, NULL, run_plan },
+	{ "save_dives", load_and_report, unload_corpus, run_save },
+	{ "process_all_dives", load_and_report, unload_corpus, run_statistics },
+	{ "uemis_parse_divelog_binary", create_uemis_blob, unload_corpus, run_uemis },
+};
+
+static void run_benchmark(struct corpus *corpus, const struct benchmark *bench)
+{
+	gint64 elapsed = 0, wallclock = g_get_monotonic_time();
+	unsigned long ops = 0, allocs = 0, bytes = 0;
+	double seconds;
+
+	/* the setup time counts against the time limit, too, so this always ends */
+	do {
+		gint64 start;
+		unsigned long start_count, start_bytes;
+
+		if (bench->setup)
+			bench->setup(corpus);
+		start_count = alloc_count;
+		start_bytes = alloc_bytes;
+		start = g_get_monotonic_time();
+		ops += bench->run(corpus);
+		elapsed += g_get_monotonic_time() - start;
+		allocs += alloc_count - start_count;
+		bytes += alloc_bytes - start_bytes;
+		if (bench->teardown)
+			bench->teardown(corpus);
+	} while (g_get_monotonic_time() - wallclock < min_time * G_USEC_PER_SEC);
+
+	seconds = elapsed / (double) G_USEC_PER_SEC;
+	if (!ops)
+		ops = 1;
+	printf("%s\t%s\t%lu\t%.6f\t%.1f", corpus->name, bench->name, ops, seconds,
+		seconds > 0 ? ops / seconds : 0.0);
+	if (HAVE_ALLOC_COUNT)
+		printf("\t%.1f\t%.1f\n", (double) allocs / ops, (double) bytes / ops);
+	else
+		printf("\t-\t-\n");
+	fflush(stdout);
+}
+
+static void run_corpus(struct corpus *corpus)
+{
+	int i;
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+		run_benchmark(corpus, benchmarks + i);
+}
+
+/*
+ * Create a synthetic logbook and turn it into an XML file in
+ * memory, so that it goes through the exact same paths as a
+ * real one.
+ */
+static void synthetic_corpus(struct corpus *corpus, const struct synthetic_options *options)
+{
+	synthesize_dives(options);
+	save_dives(save_filename);
+	clear_dive_table();
+
+	corpus->name = "synthetic";
+	corpus->nr = 1;
+	corpus->files = calloc(1, sizeof(struct memblock));
+	corpus->filenames = calloc(1, sizeof(char *));
+	corpus->filenames[0] = save_filename;
+	if (readfile(save_filename, corpus->files) < 0) {
+		fprintf(stderr, "unable to read back synthetic logbook %s\n", save_filename);
+		exit(1);
+	}
+}
+
+static void file_corpus(struct corpus *corpus, int argc, char **argv)
+{
+	int i;
+
+	corpus->name = "files";
+	corpus->nr = 0;
+	corpus->files = calloc(argc, sizeof(struct memblock));
+	corpus->filenames = calloc(argc, sizeof(char *));
+	for (i = 0; i < argc; i++) {
+		if (readfile(argv[i], corpus->files + corpus->nr) < 0) {
+			fprintf(stderr, "unable to read %s\n", argv[i]);
+			continue;
+		}
+		corpus->filenames[corpus->nr++] = argv[i];
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t seconds] " SYNTHETIC_USAGE " [file.xml ...]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	struct synthetic_options options = default_synthetic_options;
+	struct corpus corpus;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		if (argv[i][1] == 't')
+			min_time = atof(argv[++i]);
+		else if (!parse_synthetic_option(&options, argv[i][1], argv[i + 1]))
+			usage(argv[0]);
+		else
+			i++;
+	}
+
+	/* the partial pressures are part of the plot info calculation */
+	prefs = default_prefs;
+	prefs.pp_graphs.po2 = prefs.pp_graphs.pn2 = prefs.pp_graphs.phe = TRUE;
+	plangflow = prefs.gflow;
+	plangfhigh = prefs.gfhigh;
+	parse_xml_init();
+	save_filename = g_build_filename(g_get_tmp_dir(), "subsurface-bench.xml", NULL);
+
+	if (HAVE_ALLOC_COUNT)
+		printf("# allocs/op and bytes/op count malloc, calloc, realloc, strdup and strndup\n"
+		       "# calls made by subsurface, not the allocations inside glib, libxml2 and libxslt\n");
+	printf("# corpus\tbenchmark\tops\tseconds\tops/sec\tallocs/op\tbytes/op\n");
+	if (i < argc) {
+		file_corpus(&corpus, argc - i, argv + i);
+		run_corpus(&corpus);
+	}
+	if (options.dives > 0) {
+		synthetic_corpus(&corpus, &options);
+		run_corpus(&corpus);
+	}
+
+	g_unlink(save_filename);
+	parse_xml_exit();
+	return 0;
+}
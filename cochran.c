@@ -5,10 +5,21 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <pthread.h>
+#include <glib/gi18n.h>
+
 #include "dive.h"
 #include "file.h"
+#include "intern.h"
 
-#define DON
+/*
+ * What we know of the format is guessed from a few files, and the
+ * sample decoding below hasn't been checked against a real CAN file
+ * and the dives Cochran's software shows for it. So only
+ * "make CFLAGS=-DCOCHRAN_DEBUG" builds the importer, which also dumps
+ * the descrambled files. Without it CAN files are refused.
+ */
+#ifdef COCHRAN_DEBUG
 
 /*
  * The Cochran file format is designed to be annoying to read. It's roughly:
@@ -35,16 +46,32 @@ static unsigned int partial_decode(unsigned int start, unsigned int end,
 {
 	unsigned i, sum = 0;
 
-	for (i = start ; i < end; i++) {
-		unsigned char d = decode[offset++];
-		if (i >= size)
-			break;
+	if (end > size)
+		end = size;
+
+	/*
+	 * Go through the decode array one run at a time, so that the
+	 * inner loops are plain byte adds the compiler can vectorize.
+	 */
+	for (i = start; i < end; ) {
+		const unsigned char *d = decode + offset;
+		const unsigned char *b = buf + i;
+		unsigned j, n = MIN(end - i, mod - offset);
+
+		if (dst) {
+			unsigned char *p = dst + i;
+			for (j = 0; j < n; j++) {
+				p[j] = d[j] + b[j];
+				sum += p[j];
+			}
+		} else {
+			for (j = 0; j < n; j++)
+				sum += (unsigned char) (d[j] + b[j]);
+		}
+		i += n;
+		offset += n;
 		if (offset == mod)
 			offset = 0;
-		d += buf[i];
-		if (dst)
-			dst[i] = d;
-		sum += d;
 	}
 	return sum;
 }
@@ -128,7 +155,7 @@ static void parse_cochran_header(const char *filename,
 		const unsigned char *decode, unsigned mod,
 		const unsigned char *in, unsigned size)
 {
-	char *buf = malloc(size);
+	unsigned char *buf = malloc(size);
 
 	/* Do the "null decode" using a one-byte decode array of '\0' */
 	partial_decode(0    , 0x0b14, "", 0, 1, in, size, buf);
@@ -194,7 +221,7 @@ static void parse_cochran_header(const char *filename,
  * common, and 02 a third of that. 11 is least common.
  *
  * There clearly are variations in the format here. And Alex has
- * a different data offset than Don/David too (see the #ifdef DON).
+ * a different data offset than Don/David too (see the cochran_formats below).
  * Christ. Maybe I've misread the patterns entirely.
  */
 static void cochran_profile_write(const unsigned char *buf, int size)
@@ -208,76 +235,259 @@ static void cochran_profile_write(const unsigned char *buf, int size)
 	}
 }
 
-static void parse_cochran_dive(const char *filename, int dive,
+/*
+ * The two data offsets above are the two layouts: after the fixed
+ * size blocks every dive has a log at 0x4914 - 256 bytes in Don's and
+ * David's files, 512 bytes in Alex's - and the samples start right
+ * after it. We don't know what is in the log yet, the date included.
+ */
+#define COCHRAN_LOG 0x4914
+
+struct cochran_format {
+	unsigned int log_size;
+};
+
+static const struct cochran_format cochran_formats[] = {
+	{ 256 },
+	{ 512 },
+};
+
+/*
+ * The descrambling of a dive. The scrambling has odd boundaries. I
+ * think the boundaries match some data structure size, but I don't
+ * know. They were discovered the same way we dynamically discover the
+ * decode size: automatically looking for least random output.
+ *
+ * The boundaries are also this confused "off-by-one" thing, the same
+ * way the file size is off by one. It's as if the cochran software
+ * forgot to write one byte at the beginning.
+ */
+static void decode_cochran_dive(const struct cochran_format *format,
 		const unsigned char *decode, unsigned mod,
-		const unsigned char *in, unsigned size)
+		const unsigned char *in, unsigned size, unsigned char *buf)
 {
-	char *buf = malloc(size);
-#ifdef DON
-	unsigned int offset = 0x4a14;
-#else
-	unsigned int offset = 0x4b14;
-#endif
+	unsigned int offset = COCHRAN_LOG + format->log_size;
 
-	/*
-	 * The scrambling has odd boundaries. I think the boundaries
-	 * match some data structure size, but I don't know. They were
-	 * discovered the same way we dynamically discover the decode
-	 * size: automatically looking for least random output.
-	 *
-	 * The boundaries are also this confused "off-by-one" thing,
-	 * the same way the file size is off by one. It's as if the
-	 * cochran software forgot to write one byte at the beginning.
-	 */
 	partial_decode(0     , 0x0fff, decode, 1, mod, in, size, buf);
 	partial_decode(0x0fff, 0x1fff, decode, 0, mod, in, size, buf);
 	partial_decode(0x1fff, 0x2fff, decode, 0, mod, in, size, buf);
 	partial_decode(0x2fff, 0x48ff, decode, 0, mod, in, size, buf);
-
-	/*
-	 * This is not all the descrambling you need - the above are just
-	 * what appears to be the fixed-size blocks. The rest is also
-	 * scrambled, but there seems to be size differences in the data,
-	 * so this just descrambles part of it:
-	 */
 	partial_decode(0x48ff, offset, decode, 0, mod, in, size, buf);
 	partial_decode(offset,   size, decode, 0, mod, in, size, buf);
+}
+
+/*
+ * Which of '00' and '01' holds the signed values? That's the one in
+ * which -1 (63) is common, in the other one 63 is rare.
+ */
+static int signed_class(const unsigned char *s, unsigned int size)
+{
+	unsigned int i, minus_one[2] = { 0, 0 };
+
+	for (i = 0; i < size; i++) {
+		if (s[i] >> 7 == 0 && (s[i] & 0x3f) == 0x3f)
+			minus_one[s[i] >> 6]++;
+	}
+	return minus_one[1] >= minus_one[0] ? 1 : 0;
+}
 
-	printf("\n%s, dive %d\n\n", filename, dive);
+/*
+ * Only a guess, to be checked against real files: every byte of the
+ * signed class is a depth change in quarter feet, six bit two's
+ * complement, and there is one of them per second. We don't know what
+ * the other classes hold, so they are skipped - the '10' values and
+ * the '11' exceptions as much as the unsigned class.
+ */
+static void cochran_parse_samples(struct divecomputer *dc, const unsigned char *s, unsigned int size)
+{
+	unsigned int i, seconds = 0;
+	int depth = 0, class = signed_class(s, size);
+
+	for (i = 0; i < size; i++) {
+		struct sample *sample;
+		int delta;
+
+		if (s[i] >> 6 != class)
+			continue;
+		delta = s[i] & 0x3f;
+		if (delta & 0x20)
+			delta -= 0x40;
+		depth += delta;
+		if (depth < 0)
+			depth = 0;
+
+		sample = prepare_sample(dc);
+		sample->time.seconds = seconds++;
+		sample->depth.mm = feet_to_mm(depth / 4.0);
+		finish_sample(dc);
+	}
+	dc->duration.seconds = seconds;
+}
+
+/* we don't know where the date is, so the dives are a day apart in file order */
+static int parse_cochran_dive(const char *filename, int nr,
+		const struct cochran_format *format,
+		const unsigned char *buf, unsigned size)
+{
+	unsigned int offset = COCHRAN_LOG + format->log_size;
+	struct dive *dive;
+
+	printf("\n%s, dive %d\n\n", filename, nr);
 	cochran_debug_write(filename, buf, size);
+	if (size <= offset)
+		return 0;
 	cochran_profile_write(buf + offset, size - offset);
 
-	free(buf);
+	dive = alloc_dive();
+	dive->when = dive->dc.when = (timestamp_t)nr * 86400;
+	dive->dc.model = intern_string("Cochran");
+	cochran_parse_samples(&dive->dc, buf + offset, size - offset);
+	record_dive(dive);
+	return 1;
+}
+
+/*
+ * The descrambling is most of the work, and the dives are independent
+ * of each other, so a few threads take turns at the next dive. The
+ * dives are turned into struct dive afterwards, in file order.
+ */
+#define COCHRAN_THREADS 4
+
+struct cochran_file {
+	const struct cochran_format *format;
+	const unsigned char *decode;
+	unsigned int mod;
+	const unsigned char *data;
+	const unsigned int *offsets;
+	int nr, next;
+	unsigned char **dives;
+	pthread_mutex_t lock;
+};
+
+static void *decode_thread(void *_file)
+{
+	struct cochran_file *file = _file;
+
+	for (;;) {
+		int i;
+		unsigned int start, size;
+
+		pthread_mutex_lock(&file->lock);
+		i = file->next++;
+		pthread_mutex_unlock(&file->lock);
+		if (i >= file->nr)
+			break;
+		start = file->offsets[i];
+		size = file->offsets[i+1] - start;
+		file->dives[i] = malloc(size);
+		if (file->dives[i])
+			decode_cochran_dive(file->format, file->decode, file->mod,
+					    file->data + start, size, file->dives[i]);
+	}
+	return NULL;
+}
+
+static void decode_cochran_dives(struct cochran_file *file)
+{
+	pthread_t threads[COCHRAN_THREADS];
+	int i, started = 0;
+
+	file->next = 0;
+	pthread_mutex_init(&file->lock, NULL);
+	for (i = 0; i < COCHRAN_THREADS - 1 && i < file->nr - 1; i++) {
+		if (pthread_create(threads + started, NULL, decode_thread, file))
+			break;
+		started++;
+	}
+	/* we do our share, and all of it if there are no threads */
+	decode_thread(file);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&file->lock);
+}
+
+/*
+ * The two layouts restart the descrambling at different places, and
+ * only the right one makes the start of the samples look less random -
+ * the same trick as for the modulus.
+ */
+static const struct cochran_format *figure_out_format(const unsigned char *decode, unsigned mod,
+		const unsigned char *in, unsigned size)
+{
+	const struct cochran_format *best = cochran_formats;
+	unsigned int start = COCHRAN_LOG + 512, end = MIN(size, start + 0x400);
+	unsigned int min = ~0u;
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS(cochran_formats) && start < end; i++) {
+		const struct cochran_format *format = cochran_formats + i;
+		unsigned int offset = COCHRAN_LOG + format->log_size;
+		unsigned int sum;
+
+		sum = partial_decode(start, end, decode, (start - offset) % mod, mod, in, size, NULL);
+		if (sum < min) {
+			min = sum;
+			best = format;
+		}
+	}
+	return best;
 }
 
 int try_to_open_cochran(const char *filename, struct memblock *mem, GError **error)
 {
-	unsigned int i;
-	unsigned int mod;
-	unsigned int *offsets, dive1, dive2;
-	unsigned char *decode = mem->buffer + 0x40001;
+	struct cochran_file file;
+	int i, mod, success = 0;
+	unsigned int dive1, dive2;
 
 	if (mem->size < 0x40000)
 		return 0;
-	offsets = mem->buffer;
-	dive1 = offsets[0];
-	dive2 = offsets[1];
+	file.data = mem->buffer;
+	file.offsets = mem->buffer;
+	file.decode = file.data + 0x40001;
+	dive1 = file.offsets[0];
+	dive2 = file.offsets[1];
 	if (dive1 < 0x40000 || dive2 < dive1 || dive2 > mem->size)
 		return 0;
 
-	mod = figure_out_modulus(decode, mem->buffer + dive1, dive2 - dive1);
+	mod = figure_out_modulus(file.decode, file.data + dive1, dive2 - dive1);
+	if (mod < 0)
+		return 0;
+	file.mod = mod;
+	file.format = figure_out_format(file.decode, mod, file.data + dive1, dive2 - dive1);
 
-	parse_cochran_header(filename, decode, mod, mem->buffer + 0x40000, dive1 - 0x40000);
+	parse_cochran_header(filename, file.decode, mod, file.data + 0x40000, dive1 - 0x40000);
 
 	for (i = 0; i < 65534; i++) {
-		dive1 = offsets[i];
-		dive2 = offsets[i+1];
+		dive1 = file.offsets[i];
+		dive2 = file.offsets[i+1];
 		if (dive2 < dive1)
 			break;
 		if (dive2 > mem->size)
 			break;
-		parse_cochran_dive(filename, i+1, decode, mod, mem->buffer + dive1, dive2 - dive1);
 	}
+	file.nr = i;
+	file.dives = calloc(file.nr, sizeof(unsigned char *));
+	if (!file.dives)
+		return 0;
+	decode_cochran_dives(&file);
 
-	exit(0);
+	for (i = 0; i < file.nr; i++) {
+		if (file.dives[i])
+			success += parse_cochran_dive(filename, i+1, file.format, file.dives[i],
+						      file.offsets[i+1] - file.offsets[i]);
+		free(file.dives[i]);
+	}
+	free(file.dives);
+	return success;
 }
+#else
+int try_to_open_cochran(const char *filename, struct memblock *mem, GError **error)
+{
+	if (error)
+		*error = g_error_new(g_quark_from_string("subsurface"), DIVE_ERROR_PARSE,
+				     _("Can't import '%s': Cochran CAN files aren't supported yet"),
+				     filename);
+	/* it isn't XML either */
+	return 1;
+}
+#endif
@@ -109,3 +109,51 @@ struct device_info *remove_device_info(const char *model, uint32_t deviceid)
 	}
 	return entry;
 }
+
+/*
+ * libdivecomputer identifies each dive by a "fingerprint" blob. We
+ * remember the one of the newest dive we got from a dive computer,
+ * so the next download can stop as soon as it gets there.
+ */
+void set_device_fingerprint(struct device_info *info, const unsigned char *data, unsigned int size)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *p;
+	unsigned int i;
+
+	if (!info || !data || !size)
+		return;
+	p = malloc(2 * size + 1);
+	if (!p)
+		return;
+	for (i = 0; i < size; i++) {
+		p[2 * i] = hex[data[i] >> 4];
+		p[2 * i + 1] = hex[data[i] & 15];
+	}
+	p[2 * size] = 0;
+	free((void *)info->fingerprint);
+	info->fingerprint = p;
+}
+
+/* returns the size of the fingerprint, 0 if there is none (or it doesn't fit) */
+unsigned int get_device_fingerprint(struct device_info *info, unsigned char *data, unsigned int size)
+{
+	const char *p;
+	unsigned int i, len;
+
+	if (!info || !info->fingerprint)
+		return 0;
+	p = info->fingerprint;
+	len = strlen(p);
+	if (!len || len & 1 || len / 2 > size)
+		return 0;
+	for (i = 0; i < len / 2; i++) {
+		int hi = g_ascii_xdigit_value(p[2 * i]);
+		int lo = g_ascii_xdigit_value(p[2 * i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return 0;
+		data[i] = hi << 4 | lo;
+	}
+	return len / 2;
+}
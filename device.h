@@ -8,6 +8,7 @@ struct device_info {
 	const char *serial_nr;
 	const char *firmware;
 	const char *nickname;
+	const char *fingerprint;	/* hex, of the newest dive we downloaded */
 	struct device_info *next;
 };
 
@@ -16,5 +17,7 @@ extern struct device_info *get_different_device_info(const char *model, uint32_t
 extern struct device_info *create_device_info(const char *model, uint32_t deviceid);
 extern struct device_info *remove_device_info(const char *model, uint32_t deviceid);
 extern struct device_info *head_of_device_info_list(void);
+extern void set_device_fingerprint(struct device_info *info, const unsigned char *data, unsigned int size);
+extern unsigned int get_device_fingerprint(struct device_info *info, unsigned char *data, unsigned int size);
 
 #endif
@@ -3,6 +3,8 @@
 
 #include <cairo.h>
 
+#include "profile.h"
+
 #define SCALE_SCREEN 1.0
 #define SCALE_PRINT (1.0 / get_screen_dpi())
 
@@ -10,20 +12,6 @@ extern void repaint_dive(void);
 extern void do_print(void);
 extern gdouble get_screen_dpi(void);
 
-/* Plot info with smoothing, velocity indication
- * and one-, two- and three-minute minimums and maximums */
-struct plot_info {
-	int nr;
-	int maxtime;
-	int meandepth, maxdepth;
-	int minpressure, maxpressure;
-	int mintemp, maxtemp;
-	double endtempcoord;
-	double maxpp;
-	gboolean has_ndl;
-	struct plot_data *entry;
-};
-
 /*
  * Cairo scaling really is horribly horribly mis-designed.
  *
@@ -2,34 +2,492 @@
 /* maintains the internal dive list structure */
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <glib/gi18n.h>
 
 #include "dive.h"
+#include "arena.h"
+#include "intern.h"
+#include "trace.h"
 
-void add_event(struct divecomputer *dc, int time, int type, int flags, int value, const char *name)
+/*
+ * While a file is read or a dive computer is downloaded, the dives,
+ * their events and their samples come out of arenas instead of one
+ * malloc each. dive_free() leaves that memory alone.
+ *
+ * Every import gets arenas of its own, which count the dives that were
+ * allocated from them. They are given back with the last of those
+ * dives, so dives that are deleted, merged away or replaced by a later
+ * import of the same file don't keep memory allocated. The dives of one
+ * import all go at once when the logbook is closed, which is when
+ * free_import_arenas() drops whatever is left.
+ *
+ * The samples have an arena of their own, so that the sample array of
+ * the dive computer that is being read can keep growing in place.
+ *
+ * A download runs in its own thread while the GUI thread keeps editing
+ * dives, so only the thread that called begin_import() and the threads
+ * that work for it - the download's parser thread, the zip readers -
+ * allocate from the arenas. Those join the import with join_import().
+ * The arenas and the import state are only touched with arena_lock held.
+ */
+#define MAX_IMPORT_THREADS 8
+
+struct import_arenas {
+	struct arena dives, samples;
+	int nr_dives;		/* allocated here and not freed yet */
+	struct import_arenas *next;
+};
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct import_arenas *imports, *current_import;
+static gboolean importing;
+static pthread_t import_threads[MAX_IMPORT_THREADS];
+static int nr_import_threads;
+
+/* called with arena_lock held */
+static void free_import(struct import_arenas *import)
 {
-	struct event *ev, **p;
-	unsigned int size, len = strlen(name);
+	struct import_arenas **p = &imports;
 
-	size = sizeof(*ev) + len + 1;
-	ev = malloc(size);
-	if (!ev)
+	while (*p != import)
+		p = &(*p)->next;
+	*p = import->next;
+	arena_free_all(&import->dives);
+	arena_free_all(&import->samples);
+	free(import);
+}
+
+void begin_import(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	importing = TRUE;
+	import_threads[0] = pthread_self();
+	nr_import_threads = 1;
+	/* without arenas of its own an import just uses malloc */
+	current_import = calloc(1, sizeof(*current_import));
+	if (current_import) {
+		current_import->next = imports;
+		imports = current_import;
+	}
+	pthread_mutex_unlock(&arena_lock);
+}
+
+void end_import(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	importing = FALSE;
+	nr_import_threads = 0;
+	if (current_import && !current_import->nr_dives)
+		free_import(current_import);
+	current_import = NULL;
+	pthread_mutex_unlock(&arena_lock);
+}
+
+/* for threads started by the importing thread, before they make any dives */
+void join_import(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	if (importing && nr_import_threads < MAX_IMPORT_THREADS)
+		import_threads[nr_import_threads++] = pthread_self();
+	pthread_mutex_unlock(&arena_lock);
+}
+
+void leave_import(void)
+{
+	int i;
+
+	pthread_mutex_lock(&arena_lock);
+	for (i = 1; i < nr_import_threads; i++) {
+		if (pthread_equal(import_threads[i], pthread_self())) {
+			import_threads[i] = import_threads[--nr_import_threads];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena_lock);
+}
+
+/* called with arena_lock held */
+static gboolean importing_here(void)
+{
+	int i;
+
+	for (i = 0; i < nr_import_threads; i++) {
+		if (pthread_equal(import_threads[i], pthread_self()))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Is this thread reading dives for an import? Only those dives are
+ * decimated and packed; the dives that are edited are left alone.
+ */
+static gboolean importing_in_this_thread(void)
+{
+	gboolean importing_dc;
+
+	pthread_mutex_lock(&arena_lock);
+	importing_dc = importing_here();
+	pthread_mutex_unlock(&arena_lock);
+	return importing_dc;
+}
+
+/* the import whose arenas 'ptr' is in, called with arena_lock held */
+static struct import_arenas *import_owning(const void *ptr)
+{
+	struct import_arenas *import;
+
+	for (import = imports; import; import = import->next) {
+		if (arena_owns(&import->dives, ptr) || arena_owns(&import->samples, ptr))
+			return import;
+	}
+	return NULL;
+}
+
+static gboolean in_import_arenas(const void *ptr)
+{
+	gboolean owned;
+
+	pthread_mutex_lock(&arena_lock);
+	owned = import_owning(ptr) != NULL;
+	pthread_mutex_unlock(&arena_lock);
+	return owned;
+}
+
+void dive_free(const void *ptr)
+{
+	if (ptr && !in_import_arenas(ptr) && !is_interned(ptr))
+		free((void *)ptr);
+}
+
+/* once no dive is left, for the arenas of dives that were never freed */
+void free_import_arenas(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	if (!dive_table.nr && !importing) {
+		while (imports)
+			free_import(imports);
+	}
+	pthread_mutex_unlock(&arena_lock);
+}
+
+static void *alloc_dive_memory(size_t size, gboolean dive)
+{
+	void *ptr = NULL;
+
+	pthread_mutex_lock(&arena_lock);
+	if (current_import && importing_here()) {
+		ptr = arena_alloc(&current_import->dives, size);
+		if (dive)
+			current_import->nr_dives++;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	return ptr ? ptr : malloc(size);
+}
+
+/* the dive itself goes last, its arenas may go with it */
+static void free_dive_memory(struct dive *dive)
+{
+	struct import_arenas *import;
+
+	pthread_mutex_lock(&arena_lock);
+	import = import_owning(dive);
+	if (import && !--import->nr_dives && import != current_import)
+		free_import(import);
+	pthread_mutex_unlock(&arena_lock);
+	if (!import)
+		free(dive);
+}
+
+static void *grow_samples(void *ptr, size_t oldsize, size_t newsize)
+{
+	struct import_arenas *import;
+	void *newptr;
+
+	pthread_mutex_lock(&arena_lock);
+	import = ptr ? import_owning(ptr) : NULL;
+	if (current_import && importing_here() && (!ptr || import == current_import)) {
+		newptr = arena_grow(&current_import->samples, ptr, oldsize, newsize);
+		pthread_mutex_unlock(&arena_lock);
+		return newptr;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	if (!import)
+		return realloc(ptr, newsize);
+	/* imported samples that are added to later on */
+	newptr = malloc(newsize);
+	if (newptr)
+		memcpy(newptr, ptr, oldsize);
+	return newptr;
+}
+
+/*
+ * prepare_sample() grows the sample array by half each time, so once a
+ * dive computer is complete up to a third of the array can be unused.
+ * Give that back: in a sample arena that is only possible for the
+ * array that was allocated last, which is the one just read.
+ */
+static void trim_samples(struct divecomputer *dc)
+{
+	size_t size = dc->samples * sizeof(struct sample);
+	struct sample *newsamples;
+	struct import_arenas *import;
+	gboolean last;
+
+	if (!dc->sample || dc->alloc_samples <= dc->samples)
+		return;
+	pthread_mutex_lock(&arena_lock);
+	import = import_owning(dc->sample);
+	last = import && dc->sample == import->samples.last;
+	if (last)
+		arena_grow(&import->samples, dc->sample, dc->alloc_samples * sizeof(struct sample), size);
+	pthread_mutex_unlock(&arena_lock);
+	if (import) {
+		if (!last)
+			return;
+		newsamples = dc->samples ? dc->sample : NULL;
+	} else {
+		newsamples = realloc(dc->sample, size);
+		if (!newsamples && size)
+			return;
+	}
+	dc->sample = newsamples;
+	dc->alloc_samples = dc->samples;
+}
+
+/*
+ * Give back the samples of 'dc', packed or not, but leave dc->samples
+ * alone. The array of the dive that was just read is the last one in
+ * its sample arena, so that space can be used for the next dive.
+ */
+void free_samples(struct divecomputer *dc)
+{
+	struct import_arenas *import = NULL;
+	gboolean last = FALSE;
+
+	pthread_mutex_lock(&arena_lock);
+	if (dc->sample) {
+		import = import_owning(dc->sample);
+		last = import && dc->sample == import->samples.last;
+	}
+	if (last)
+		arena_grow(&import->samples, dc->sample, dc->alloc_samples * sizeof(struct sample), 0);
+	pthread_mutex_unlock(&arena_lock);
+	if (!import)
+		dive_free(dc->sample);
+	free(dc->packed);
+	dc->sample = NULL;
+	dc->packed = NULL;
+	dc->alloc_samples = 0;
+}
+
+/* does 'sample' carry anything besides depth that must not be dropped? */
+static gboolean sample_has_data(struct sample *sample, struct sample *prev)
+{
+	if (sample->cylinderpressure.mbar || sample->temperature.mkelvin)
+		return TRUE;
+	return sample->in_deco != prev->in_deco ||
+		sample->ndl.seconds != prev->ndl.seconds ||
+		sample->stoptime.seconds != prev->stoptime.seconds ||
+		sample->stopdepth.mm != prev->stopdepth.mm ||
+		sample->po2 != prev->po2 ||
+		sample->cns != prev->cns ||
+		sample->sensor != prev->sensor;
+}
+
+/* how far (in mm) 'k' is off the straight line from 'a' to 'b' */
+static int depth_error(struct sample *a, struct sample *b, struct sample *k)
+{
+	int dt = b->time.seconds - a->time.seconds;
+	long long depth = a->depth.mm;
+
+	if (dt > 0)
+		depth += (long long)(b->depth.mm - a->depth.mm) * (k->time.seconds - a->time.seconds) / dt;
+	return abs(k->depth.mm - (int)depth);
+}
+
+/*
+ * Mark the samples of 'dc' that are needed to draw its depth profile
+ * to within 'tolerance' mm: the first, last and deepest samples, the
+ * first sample at or after each event and every sample that carries
+ * pressure, temperature or a change in deco state are always kept, and
+ * the stretches in between are simplified with Douglas-Peucker.
+ *
+ * Returns the number of samples kept, or -1 if we ran out of memory,
+ * in which case nothing should be dropped.
+ */
+int simplify_samples(struct divecomputer *dc, int tolerance, char *keep)
+{
+	int nr = dc->samples, i, kept, deepest = 0, sp = 0, last = 0;
+	struct sample *s = dc->sample;
+	struct event *ev = dc->events;
+	int (*stack)[2];
+
+	if (nr <= 2) {
+		memset(keep, 1, nr);
+		return nr;
+	}
+	stack = malloc(nr * sizeof(*stack));
+	if (!stack)
+		return -1;
+
+	memset(keep, 0, nr);
+	keep[0] = keep[nr - 1] = 1;
+	for (i = 1; i < nr; i++) {
+		if (s[i].depth.mm > s[deepest].depth.mm)
+			deepest = i;
+		if (sample_has_data(s + i, s + i - 1))
+			keep[i] = 1;
+		for (; ev && ev->time.seconds <= s[i].time.seconds; ev = ev->next)
+			if (ev->time.seconds > s[i - 1].time.seconds)
+				keep[i] = 1;
+	}
+	keep[deepest] = 1;
+
+	/* every stretch between two kept samples is simplified on its own */
+	for (i = 1; i < nr; i++) {
+		if (!keep[i])
+			continue;
+		if (i - last > 1) {
+			stack[sp][0] = last;
+			stack[sp][1] = i;
+			sp++;
+		}
+		last = i;
+	}
+	while (sp > 0) {
+		int a, b, k, worst = 0, maxerr = 0;
+
+		sp--;
+		a = stack[sp][0];
+		b = stack[sp][1];
+		for (k = a + 1; k < b; k++) {
+			int err = depth_error(s + a, s + b, s + k);
+			if (err > maxerr) {
+				maxerr = err;
+				worst = k;
+			}
+		}
+		if (maxerr <= tolerance)
+			continue;
+		keep[worst] = 1;
+		if (worst - a > 1) {
+			stack[sp][0] = a;
+			stack[sp][1] = worst;
+			sp++;
+		}
+		if (b - worst > 1) {
+			stack[sp][0] = worst;
+			stack[sp][1] = b;
+			sp++;
+		}
+	}
+	free(stack);
+
+	for (kept = i = 0; i < nr; i++)
+		kept += keep[i];
+	return kept;
+}
+
+/*
+ * Depth tolerance in mm for simplifying profiles, set from the command
+ * line with --decimate. 0 keeps every sample. This is deliberately not
+ * a preference: it only lasts for this run and is never saved.
+ */
+int sample_tolerance;
+
+/*
+ * drop the samples simplify_samples() doesn't need, when asked to, from
+ * the dives of an import - also those the parser thread of a download
+ * records, which joins the import
+ */
+static void decimate_samples(struct divecomputer *dc)
+{
+	int i, j, nr = dc->samples;
+	char *keep;
+
+	if (sample_tolerance <= 0 || nr <= 2 || !importing_in_this_thread())
 		return;
-	memset(ev, 0, size);
-	memcpy(ev->name, name, len);
+	keep = malloc(nr);
+	if (!keep)
+		return;
+	if (simplify_samples(dc, sample_tolerance, keep) >= 0) {
+		for (i = j = 0; i < nr; i++)
+			if (keep[i])
+				dc->sample[j++] = dc->sample[i];
+		dc->samples = j;
+		if (verbose)
+			fprintf(stderr, "decimated %d samples to %d (%.1f:1)\n",
+				nr, j, (double)nr / j);
+	}
+	free(keep);
+}
+
+/* insert a new event into a sorted event list, looking for its place from *p on */
+static struct event *insert_event(struct event **p, int time, int type, int flags, int value, const char *name)
+{
+	struct event *ev;
+
+	ev = alloc_dive_memory(sizeof(*ev), FALSE);
+	if (!ev)
+		return NULL;
+	memset(ev, 0, sizeof(*ev));
+	ev->name = intern_string(name);
 	ev->time.seconds = time;
 	ev->type = type;
 	ev->flags = flags;
 	ev->value = value;
 
-	p = &dc->events;
-
 	/* insert in the sorted list of events */
 	while (*p && (*p)->time.seconds < time)
 		p = &(*p)->next;
 	ev->next = *p;
 	*p = ev;
-	remember_event(name);
+	remember_event(ev->name);
+	return ev;
+}
+
+void add_event(struct divecomputer *dc, int time, int type, int flags, int value, const char *name)
+{
+	insert_event(&dc->events, time, type, flags, value, name);
+}
+
+/*
+ * Importers add events in time order, so searching from the start of the
+ * list for each one is quadratic. They can pass in the event they added
+ * last instead: anything later than that goes somewhere after it.
+ */
+struct event *add_event_after(struct divecomputer *dc, struct event *last, int time, int type, int flags, int value, const char *name)
+{
+	if (last && last->time.seconds < time)
+		return insert_event(&last->next, time, type, flags, value, name);
+	return insert_event(&dc->events, time, type, flags, value, name);
+}
+
+void gas_cursor_init(struct gas_cursor *cursor, struct divecomputer *dc, int o2, int he)
+{
+	cursor->next = get_next_event(dc->events, "gaschange");
+	cursor->o2 = o2;
+	cursor->he = he;
+}
+
+/* apply all gas changes up to and including 'time' */
+void gas_cursor_advance(struct gas_cursor *cursor, int time)
+{
+	struct event *ev = cursor->next;
+
+	while (ev && ev->time.seconds <= time) {
+		cursor->o2 = 10 * (ev->value & 0xffff);
+		cursor->he = 10 * (ev->value >> 16);
+		ev = get_next_event(ev->next, "gaschange");
+	}
+	cursor->next = ev;
+}
+
+struct units *get_units()
+{
+	return &prefs.units;
 }
 
 int get_pressure_units(unsigned int mb, const char **units)
@@ -150,33 +608,66 @@ double get_weight_units(unsigned int grams, int *frac, const char **units)
 	return value;
 }
 
+gboolean cylinder_nodata(cylinder_t *cyl)
+{
+	return	!cyl->type.size.mliter &&
+		!cyl->type.workingpressure.mbar &&
+		!cyl->type.description &&
+		!cyl->gasmix.o2.permille &&
+		!cyl->gasmix.he.permille &&
+		!cyl->start.mbar &&
+		!cyl->end.mbar;
+}
+
+static gboolean cylinder_nosamples(cylinder_t *cyl)
+{
+	return	!cyl->sample_start.mbar &&
+		!cyl->sample_end.mbar;
+}
+
+gboolean cylinder_none(void *_data)
+{
+	cylinder_t *cyl = _data;
+	return cylinder_nodata(cyl) && cylinder_nosamples(cyl);
+}
+
 struct dive *alloc_dive(void)
 {
 	struct dive *dive;
 
-	dive = malloc(sizeof(*dive));
+	dive = alloc_dive_memory(sizeof(*dive), TRUE);
 	if (!dive)
 		exit(1);
 	memset(dive, 0, sizeof(*dive));
 	return dive;
 }
 
+/* make room for 'nr' samples, for importers that know how many they'll add */
+gboolean reserve_samples(struct divecomputer *dc, int nr)
+{
+	struct sample *newsamples;
+
+	if (!unpack_samples(dc))
+		return FALSE;
+	if (nr <= dc->alloc_samples)
+		return TRUE;
+	newsamples = grow_samples(dc->sample, dc->alloc_samples * sizeof(struct sample),
+				  nr * sizeof(struct sample));
+	if (!newsamples)
+		return FALSE;
+	dc->alloc_samples = nr;
+	dc->sample = newsamples;
+	return TRUE;
+}
+
 struct sample *prepare_sample(struct divecomputer *dc)
 {
 	if (dc) {
 		int nr = dc->samples;
-		int alloc_samples = dc->alloc_samples;
 		struct sample *sample;
-		if (nr >= alloc_samples) {
-			struct sample *newsamples;
-
-			alloc_samples = (alloc_samples * 3)/2 + 10;
-			newsamples = realloc(dc->sample, alloc_samples * sizeof(struct sample));
-			if (!newsamples)
-				return NULL;
-			dc->alloc_samples = alloc_samples;
-			dc->sample = newsamples;
-		}
+		if (nr >= dc->alloc_samples &&
+		    !reserve_samples(dc, (dc->alloc_samples * 3)/2 + 10))
+			return NULL;
 		sample = dc->sample + nr;
 		memset(sample, 0, sizeof(*sample));
 		return sample;
@@ -450,22 +941,6 @@ static gboolean is_potentially_redundant(struct event *event)
 	return TRUE;
 }
 
-/* match just by name - we compare the details in the code that uses this helper */
-static struct event *find_previous_event(struct divecomputer *dc, struct event *event)
-{
-	struct event *ev = dc->events;
-	struct event *previous = NULL;
-
-	if (!event->name)
-		return NULL;
-	while (ev && ev != event) {
-		if (ev->name && !strcmp(ev->name, event->name))
-			previous = ev;
-		ev = ev->next;
-	}
-	return previous;
-}
-
 static void fixup_surface_pressure(struct dive *dive)
 {
 	struct divecomputer *dc;
@@ -588,24 +1063,31 @@ static void un_fixup_airtemp(struct dive *a)
 static void fixup_dc_events(struct divecomputer *dc)
 {
 	struct event *event;
+	GHashTable *previous;
 
+	if (!dc->events)
+		return;
+	/* the previous event of the same name, keyed by the interned name */
+	previous = g_hash_table_new(g_direct_hash, g_direct_equal);
 	event = dc->events;
 	while (event) {
 		struct event *prev;
 		if (is_potentially_redundant(event)) {
-			prev = find_previous_event(dc, event);
+			prev = g_hash_table_lookup(previous, event->name);
 			if (prev && prev->value == event->value &&
 			    prev->flags == event->flags &&
 			    event->time.seconds - prev->time.seconds < 61)
 				event->deleted = TRUE;
+			g_hash_table_insert(previous, (void *)event->name, event);
 		}
 		event = event->next;
 	}
+	g_hash_table_destroy(previous);
 	event = dc->events;
 	while (event) {
 		if (event->next && event->next->deleted) {
 			struct event *nextnext = event->next->next;
-			free(event->next);
+			dive_free(event->next);
 			event->next = nextnext;
 		} else {
 			event = event->next;
@@ -625,6 +1107,9 @@ static void fixup_dive_dc(struct dive *dive, struct divecomputer *dc)
 	int lasttemp = 0, lastpressure = 0;
 	int pressure_delta[MAX_CYLINDERS] = {INT_MAX, };
 
+	if (!unpack_samples(dc))
+		return;
+
 	/* Fixup duration and mean depth */
 	fixup_dc_duration(dc);
 
@@ -722,10 +1207,16 @@ static void fixup_dive_dc(struct dive *dive, struct divecomputer *dc)
 	if (maxdepth > dive->maxdepth.mm)
 		dive->maxdepth.mm = maxdepth;
 	fixup_dc_events(dc);
+	decimate_samples(dc);
+	trim_samples(dc);
+	/* dives that are read in aren't displayed yet, the download's parser thread included */
+	if (importing_in_this_thread())
+		pack_samples(dc);
 }
 
 struct dive *fixup_dive(struct dive *dive)
 {
+	TRACE_SPAN("fixup_dive");
 	int i;
 	struct divecomputer *dc;
 
@@ -734,6 +1225,7 @@ struct dive *fixup_dive(struct dive *dive)
 	add_location(dive->location);
 	add_suit(dive->suit);
 	sanitize_cylinder_info(dive);
+	dive->metrics_valid = FALSE;
 	dive->maxcns = dive->cns;
 
 	for_each_dc(dive, dc)
@@ -766,6 +1258,7 @@ struct dive *fixup_dive(struct dive *dive)
 #define MERGE_MAX(res, a, b, n) res->n = MAX(a->n, b->n)
 #define MERGE_MIN(res, a, b, n) res->n = (a->n)?(b->n)?MIN(a->n, b->n):(a->n):(b->n)
 #define MERGE_TXT(res, a, b, n) res->n = merge_text(a->n, b->n)
+#define MERGE_STR(res, a, b, n) res->n = merge_string(a->n, b->n)
 #define MERGE_NONZERO(res, a, b, n) res->n = a->n ? a->n : b->n
 
 static struct sample *add_sample(struct sample *sample, int time, struct divecomputer *dc)
@@ -922,6 +1415,21 @@ static char *merge_text(const char *a, const char *b)
 	return res;
 }
 
+/* the same, for the interned metadata strings */
+static char *merge_string(const char *a, const char *b)
+{
+	char *text;
+	const char *res;
+
+	if (a == b)
+		return (char *)intern_string(a);
+	text = merge_text(a, b);
+	res = intern_string(text);
+	if (text != a)
+		free(text);
+	return (char *)res;
+}
+
 #define SORT(a,b,field) \
 	if (a->field != b->field) return a->field < b->field ? -1 : 1
 
@@ -931,6 +1439,8 @@ static int sort_event(struct event *a, struct event *b)
 	SORT(a,b,type);
 	SORT(a,b,flags);
 	SORT(a,b,value);
+	if (a->name == b->name)
+		return 0;
 	return strcmp(a->name, b->name);
 }
 
@@ -1230,19 +1740,21 @@ pick_b:
 
 #if CURRENTLY_NOT_USED
 /*
- * Sample 's' is between samples 'a' and 'b'. It is 'offset' seconds before 'b'.
+ * Sample 'si' of 's' is between samples 'ai' and 'ai+1' of 'a'. It
+ * is 'offset' seconds before 'ai+1'.
  *
- * If 's' and 'a' are at the same time, offset is 0, and b is NULL.
+ * If 'si' and 'ai' are at the same time, offset is 0.
  */
-static int compare_sample(struct sample *s, struct sample *a, struct sample *b, int offset)
+static int compare_sample(const struct sample_columns *s, int si,
+			  const struct sample_columns *a, int ai, int offset)
 {
-	unsigned int depth = a->depth.mm;
+	unsigned int depth = sample_depth(a, ai).mm;
 	int diff;
 
 	if (offset) {
-		unsigned int interval = b->time.seconds - a->time.seconds;
-		unsigned int depth_a = a->depth.mm;
-		unsigned int depth_b = b->depth.mm;
+		unsigned int interval = sample_time(a, ai + 1).seconds - sample_time(a, ai).seconds;
+		unsigned int depth_a = sample_depth(a, ai).mm;
+		unsigned int depth_b = sample_depth(a, ai + 1).mm;
 
 		if (offset > interval)
 			return -1;
@@ -1251,7 +1763,7 @@ static int compare_sample(struct sample *s, struct sample *a, struct sample *b,
 		depth = (depth_a * offset) + (depth_b * (interval - offset));
 		depth /= interval;
 	}
-	diff = s->depth.mm - depth;
+	diff = sample_depth(s, si).mm - depth;
 	if (diff < 0)
 		diff = -diff;
 	/* cut off at one meter difference */
@@ -1265,58 +1777,50 @@ static int compare_sample(struct sample *s, struct sample *a, struct sample *b,
  * the offset in seconds between them. Use this to find the best
  * match of samples between two different dive computers.
  */
-static unsigned long sample_difference(struct divecomputer *a, struct divecomputer *b, int offset)
+static unsigned long sample_difference(const struct sample_columns *a, const struct sample_columns *b, int offset)
 {
-	int asamples = a->samples;
-	int bsamples = b->samples;
-	struct sample *as = a->sample;
-	struct sample *bs = b->sample;
 	unsigned long error = 0;
 	int start = -1;
+	int ai, bi;
 
-	if (!asamples || !bsamples)
+	if (!a->nr || !b->nr)
 		return 0;
 
 	/*
 	 * skip the first sample - this way we know can always look at
-	 * as/bs[-1] to look at the samples around it in the loop.
+	 * the sample before ai/bi to look at the samples around it in
+	 * the loop.
 	 */
-	as++; bs++;
-	asamples--;
-	bsamples--;
+	ai = bi = 1;
 
 	for (;;) {
 		int at, bt, diff;
 
 
 		/* If we run out of samples, punt */
-		if (!asamples)
+		if (ai >= a->nr)
 			return INT_MAX;
-		if (!bsamples)
+		if (bi >= b->nr)
 			return INT_MAX;
 
-		at = as->time.seconds;
-		bt = bs->time.seconds + offset;
+		at = sample_time(a, ai).seconds;
+		bt = sample_time(b, bi).seconds + offset;
 
 		/* b hasn't started yet? Ignore it */
 		if (bt < 0) {
-			bs++;
-			bsamples--;
+			bi++;
 			continue;
 		}
 
 		if (at < bt) {
-			diff = compare_sample(as, bs-1, bs, bt - at);
-			as++;
-			asamples--;
+			diff = compare_sample(a, ai, b, bi - 1, bt - at);
+			ai++;
 		} else if (at > bt) {
-			diff = compare_sample(bs, as-1, as, at - bt);
-			bs++;
-			bsamples--;
+			diff = compare_sample(b, bi, a, ai - 1, at - bt);
+			bi++;
 		} else {
-			diff = compare_sample(as, bs, NULL, 0);
-			as++; bs++;
-			asamples--; bsamples--;
+			diff = compare_sample(a, ai, b, bi, 0);
+			ai++; bi++;
 		}
 
 		/* Invalid comparison point? */
@@ -1351,6 +1855,7 @@ static unsigned long sample_difference(struct divecomputer *a, struct divecomput
  */
 static int find_sample_offset(struct divecomputer *a, struct divecomputer *b)
 {
+	struct sample_columns acols, bcols;
 	int offset, best;
 	unsigned long max;
 
@@ -1360,6 +1865,14 @@ static int find_sample_offset(struct divecomputer *a, struct divecomputer *b)
 	if (!b->samples)
 		return 0;
 
+	/* the 62 passes below only look at the time and depth */
+	if (!get_sample_columns(&acols, a, 1 << COLUMN_TIME | 1 << COLUMN_DEPTH))
+		return 0;
+	if (!get_sample_columns(&bcols, b, 1 << COLUMN_TIME | 1 << COLUMN_DEPTH)) {
+		free_sample_columns(&acols);
+		return 0;
+	}
+
 	/*
 	 * Common special-case: merging a dive that came from
 	 * the same dive computer, so the samples are identical.
@@ -1367,9 +1880,9 @@ static int find_sample_offset(struct divecomputer *a, struct divecomputer *b)
 	 * some minimal offset case.
 	 */
 	best = 0;
-	max = sample_difference(a, b, 0);
+	max = sample_difference(&acols, &bcols, 0);
 	if (!max)
-		return 0;
+		goto out;
 
 	/*
 	 * Otherwise, look if we can find anything better within
@@ -1378,13 +1891,16 @@ static int find_sample_offset(struct divecomputer *a, struct divecomputer *b)
 	for (offset = -30; offset <= 30; offset++) {
 		unsigned long diff;
 
-		diff = sample_difference(a, b, offset);
+		diff = sample_difference(&acols, &bcols, offset);
 		if (diff > max)
 			continue;
 		best = offset;
 		max = diff;
 	}
 
+out:
+	free_sample_columns(&acols);
+	free_sample_columns(&bcols);
 	return best;
 }
 #endif
@@ -1434,7 +1950,7 @@ int match_one_dc(struct divecomputer *a, struct divecomputer *b)
 	/* Not same model? Don't know if matching.. */
 	if (!a->model || !b->model)
 		return 0;
-	if (strcasecmp(a->model, b->model))
+	if (a->model != b->model && strcasecmp(a->model, b->model))
 		return 0;
 
 	/* Different device ID's? Don't know */
@@ -1554,20 +2070,40 @@ static void free_events(struct event *ev)
 {
 	while (ev) {
 		struct event *next = ev->next;
-		free(ev);
+		dive_free(ev);
 		ev = next;
 	}
 }
 
 static void free_dc(struct divecomputer *dc)
 {
-	free(dc->sample);
-	if (dc->model)
-		free((void *)dc->model);
+	free_samples(dc);
+	dive_free(dc->model);
 	free_events(dc->events);
 	free(dc);
 }
 
+/* free a dive that is no longer in any table, with all its dive computers */
+void free_dive(struct dive *dive)
+{
+	struct divecomputer *dc = dive->dc.next;
+
+	while (dc) {
+		struct divecomputer *next = dc->next;
+		free_dc(dc);
+		dc = next;
+	}
+	free_samples(&dive->dc);
+	free_events(dive->dc.events);
+	dive_free(dive->location);
+	if (dive->notes)
+		free((void *)dive->notes);
+	dive_free(dive->divemaster);
+	dive_free(dive->buddy);
+	dive_free(dive->suit);
+	free_dive_memory(dive);
+}
+
 static int same_event(struct event *a, struct event *b)
 {
 	if (a->time.seconds != b->time.seconds)
@@ -1578,7 +2114,7 @@ static int same_event(struct event *a, struct event *b)
 		return 0;
 	if (a->value != b->value)
 		return 0;
-	return !strcmp(a->name, b->name);
+	return a->name == b->name;
 }
 
 static int same_sample(struct sample *a, struct sample *b)
@@ -1683,9 +2219,10 @@ static struct divecomputer *find_matching_computer(struct divecomputer *match, s
 static void copy_dive_computer(struct divecomputer *res, struct divecomputer *a)
 {
 	*res = *a;
-	res->model = a->model ? strdup(a->model) : NULL;
+	res->model = intern_string(a->model);
 	res->samples = res->alloc_samples = 0;
 	res->sample = NULL;
+	res->packed = NULL;
 	res->events = NULL;
 	res->next = NULL;
 }
@@ -1709,6 +2246,9 @@ static void interleave_dive_computers(struct divecomputer *res,
 		match = find_matching_computer(a, b);
 		if (match) {
 			merge_events(res, a, match, offset);
+			/* the events now belong to 'res' */
+			a->events = NULL;
+			match->events = NULL;
 			merge_samples(res, a, match, offset);
 		} else {
 			res->sample = a->sample;
@@ -1768,11 +2308,62 @@ static void join_dive_computers(struct divecomputer *res, struct divecomputer *a
 	remove_redundant_dc(res, prefer_downloaded);
 }
 
+/*
+ * The merged dive takes over the samples and events of the dives it is
+ * made of. Those can't stay in the arenas of an import, which go away
+ * with the last dive that was allocated from them.
+ */
+static gboolean move_out_of_arenas(struct divecomputer *dc)
+{
+	struct event **p, *ev;
+
+	if (dc->sample && in_import_arenas(dc->sample)) {
+		struct sample *sample = NULL;
+
+		if (dc->samples) {
+			sample = malloc(dc->samples * sizeof(*sample));
+			if (!sample)
+				return FALSE;
+			memcpy(sample, dc->sample, dc->samples * sizeof(*sample));
+		}
+		dc->sample = sample;
+		dc->alloc_samples = dc->samples;
+	}
+	for (p = &dc->events; (ev = *p) != NULL; p = &(*p)->next) {
+		if (in_import_arenas(ev)) {
+			struct event *copy = malloc(sizeof(*copy));
+
+			if (!copy)
+				return FALSE;
+			*copy = *ev;
+			*p = copy;
+		}
+	}
+	return TRUE;
+}
+
+static gboolean move_dive_out_of_arenas(struct dive *dive)
+{
+	struct divecomputer *dc;
+
+	for_each_dc(dive, dc) {
+		if (!move_out_of_arenas(dc))
+			return FALSE;
+	}
+	return TRUE;
+}
+
 struct dive *merge_dives(struct dive *a, struct dive *b, int offset, gboolean prefer_downloaded)
 {
-	struct dive *res = alloc_dive();
+	struct dive *res;
 	struct dive *dl = NULL;
 
+	if (!unpack_dive(a) || !unpack_dive(b))
+		return NULL;
+	if (!move_dive_out_of_arenas(a) || !move_dive_out_of_arenas(b))
+		return NULL;
+	res = alloc_dive();
+
 	/* Aim for newly downloaded dives to be 'b' (keep old dive data first) */
 	if (a->downloaded && !b->downloaded) {
 		struct dive *tmp = a;
@@ -1787,12 +2378,12 @@ struct dive *merge_dives(struct dive *a, struct dive *b, int offset, gboolean pr
 	merge_trip(res, a, b);
 	MERGE_NONZERO(res, a, b, latitude.udeg);
 	MERGE_NONZERO(res, a, b, longitude.udeg);
-	MERGE_TXT(res, a, b, location);
+	MERGE_STR(res, a, b, location);
 	MERGE_TXT(res, a, b, notes);
-	MERGE_TXT(res, a, b, buddy);
-	MERGE_TXT(res, a, b, divemaster);
+	MERGE_STR(res, a, b, buddy);
+	MERGE_STR(res, a, b, divemaster);
 	MERGE_MAX(res, a, b, rating);
-	MERGE_TXT(res, a, b, suit);
+	MERGE_STR(res, a, b, suit);
 	MERGE_MAX(res, a, b, number);
 	MERGE_NONZERO(res, a, b, cns);
 	MERGE_NONZERO(res, a, b, visibility);
@@ -1807,6 +2398,8 @@ struct dive *merge_dives(struct dive *a, struct dive *b, int offset, gboolean pr
 		join_dive_computers(&res->dc, &a->dc, &b->dc, 0);
 
 	fixup_dive(res);
+	if (!res->selected)
+		pack_dive(res);
 	return res;
 }
 
@@ -258,18 +258,22 @@ static inline int interpolate(int a, int b, int part, int whole)
 	return rint(x / whole);
 }
 
+/*
+ * Every sample loop streams through all of these, so the fields that
+ * only ever hold small values are kept narrow: 36 bytes instead of 44.
+ */
 struct sample {
 	duration_t time;
 	depth_t depth;
 	temperature_t temperature;
 	pressure_t cylinderpressure;
-	int sensor;		/* Cylinder pressure sensor index */
 	duration_t ndl;
 	duration_t stoptime;
 	depth_t stopdepth;
-	gboolean in_deco;
-	int cns;
-	int po2;
+	uint16_t cns;		/* in percent */
+	uint16_t po2;		/* in mbar */
+	uint8_t sensor;		/* Cylinder pressure sensor index */
+	uint8_t in_deco;
 };
 
 /*
@@ -285,7 +289,7 @@ struct event {
 	duration_t time;
 	int type, flags, value;
 	gboolean deleted;
-	char name[];
+	const char *name; /* interned, so names can be compared by pointer */
 };
 
 /*
@@ -312,6 +316,7 @@ struct divecomputer {
 	uint32_t deviceid, diveid;
 	int samples, alloc_samples;
 	struct sample *sample;
+	struct packed_samples *packed;	/* instead of 'sample', see samples.c */
 	struct event *events;
 	struct divecomputer *next;
 };
@@ -355,6 +360,9 @@ struct dive {
 	weightsystem_t weightsystem[MAX_WEIGHTSYSTEMS];
 	char *suit;
 	int sac, otu, cns, maxcns;
+	/* cached by update_dive_metrics() */
+	gboolean metrics_valid, cns_calculated;
+	double cns_exposure;
 
 	/* Calculated based on dive computer data */
 	temperature_t mintemp, maxtemp, watertemp, airtemp;
@@ -567,6 +575,12 @@ extern int match_one_dc(struct divecomputer *a, struct divecomputer *b);
 
 extern void parse_xml_init(void);
 extern void parse_xml_buffer(const char *url, const char *buf, int size, struct dive_table *table, GError **error);
+extern void parse_xml_io(const char *url, int (*read)(void *context, char *buf, int len), void *context,
+			 struct dive_table *table, GError **error);
+extern xmlDoc *load_xml_buffer(const char *url, const char *buf, int size, GError **error);
+extern xmlDoc *load_xml_io(const char *url, int (*read)(void *context, char *buf, int len), void *context,
+			   GError **error);
+extern void parse_xml_doc(xmlDoc *doc, struct dive_table *table);
 extern void parse_xml_exit(void);
 extern void set_filename(const char *filename, gboolean force);
 
@@ -600,10 +614,99 @@ extern timestamp_t utc_mktime(struct tm *tm);
 extern void utc_mkdate(timestamp_t, struct tm *tm);
 
 extern struct dive *alloc_dive(void);
+extern void free_dive(struct dive *dive);
+extern void dive_free(const void *ptr);
+extern void begin_import(void);
+extern void end_import(void);
+extern void join_import(void);
+extern void leave_import(void);
+extern void free_import_arenas(void);
 extern void record_dive(struct dive *dive);
 
 extern struct sample *prepare_sample(struct divecomputer *dc);
+extern gboolean reserve_samples(struct divecomputer *dc, int nr);
 extern void finish_sample(struct divecomputer *dc);
+extern int simplify_samples(struct divecomputer *dc, int tolerance, char *keep);
+extern int sample_tolerance;
+extern void free_samples(struct divecomputer *dc);
+
+/*
+ * The samples of a dive that isn't displayed can be packed: dc->sample
+ * is NULL then, while dc->samples still counts them. Read them in order
+ * with for_each_sample(), and unpack them before changing them.
+ */
+#define SAMPLE_COLUMNS 11
+
+/* one for each field of struct sample, SAMPLE_COLUMNS of them */
+enum sample_column_id {
+	COLUMN_TIME, COLUMN_DEPTH, COLUMN_TEMPERATURE, COLUMN_PRESSURE,
+	COLUMN_NDL, COLUMN_STOPTIME, COLUMN_STOPDEPTH, COLUMN_CNS,
+	COLUMN_PO2, COLUMN_SENSOR, COLUMN_IN_DECO
+};
+
+struct sample_column {
+	const unsigned char *pos;
+	unsigned long long code;
+	int run, last;
+};
+
+struct sample_reader {
+	struct divecomputer *dc;
+	int index;
+	struct sample_column column[SAMPLE_COLUMNS];
+	struct sample sample;
+};
+
+extern int compress_samples;
+extern void start_samples(struct sample_reader *reader, struct divecomputer *dc);
+extern const struct sample *next_sample(struct sample_reader *reader);
+extern void pack_samples(struct divecomputer *dc);
+extern gboolean unpack_samples(struct divecomputer *dc);
+extern void pack_dive(struct dive *dive);
+extern gboolean unpack_dive(struct dive *dive);
+
+#define for_each_sample(_reader,_dc,_s) \
+	for (start_samples(&(_reader), (_dc)); ((_s) = next_sample(&(_reader))) != NULL; )
+
+/*
+ * A few fields of all the samples of a divecomputer, each in an array
+ * of its own, for the loops that only look at those: a pass over the
+ * depths then reads the depths and nothing else. get_sample_columns()
+ * fills those of the time, depth, po2 and sensor columns that are asked
+ * for with (1 << COLUMN_xxx) bits - only those are decoded from packed
+ * samples - and leaves the others NULL.
+ */
+struct sample_columns {
+	int nr;
+	duration_t *time;
+	depth_t *depth;
+	uint16_t *po2;
+	uint8_t *sensor;
+	void *data;
+};
+
+extern gboolean get_sample_columns(struct sample_columns *cols, struct divecomputer *dc, unsigned int which);
+extern void free_sample_columns(struct sample_columns *cols);
+
+static inline duration_t sample_time(const struct sample_columns *cols, int i)
+{
+	return cols->time[i];
+}
+
+static inline depth_t sample_depth(const struct sample_columns *cols, int i)
+{
+	return cols->depth[i];
+}
+
+static inline int sample_po2(const struct sample_columns *cols, int i)
+{
+	return cols->po2[i];
+}
+
+static inline int sample_sensor(const struct sample_columns *cols, int i)
+{
+	return cols->sensor[i];
+}
 
 extern void sort_table(struct dive_table *table);
 extern void report_dives(gboolean imported, gboolean prefer_imported);
@@ -615,6 +718,20 @@ extern void renumber_dives(int nr);
 
 extern void add_gas_switch_event(struct dive *dive, struct divecomputer *dc, int time, int idx);
 extern void add_event(struct divecomputer *dc, int time, int type, int flags, int value, const char *name);
+extern struct event *add_event_after(struct divecomputer *dc, struct event *last, int time, int type, int flags, int value, const char *name);
+
+/*
+ * Look up the gas in use for increasing times: the cursor only moves
+ * forward through the gas change events, so walking all the samples
+ * of a dive visits each event once instead of once per sample.
+ */
+struct gas_cursor {
+	struct event *next;
+	int o2, he;
+};
+
+extern void gas_cursor_init(struct gas_cursor *cursor, struct divecomputer *dc, int o2, int he);
+extern void gas_cursor_advance(struct gas_cursor *cursor, int time);
 
 /* UI related protopypes */
 
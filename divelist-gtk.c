@@ -38,6 +38,7 @@
 #include "display.h"
 #include "display-gtk.h"
 #include "webservice.h"
+#include "trace.h"
 
 #include <gdk-pixbuf/gdk-pixdata.h>
 #include "satellite.h"
@@ -60,7 +61,6 @@ static struct DiveList dive_list;
 #define LISTSTORE(_dl) GTK_TREE_STORE((_dl).listmodel)
 
 dive_trip_t *dive_trip_list;
-short autogroup = FALSE;
 static gboolean in_set_cursor = FALSE;
 static gboolean set_selected(GtkTreeModel *model, GtkTreePath *path,
 			     GtkTreeIter *iter, gpointer data);
@@ -561,12 +561,16 @@ GdkPixbuf *get_gps_icon(void)
 	return gdk_pixbuf_from_pixdata(&satellite_pixbuf, TRUE, NULL);
 }
 
+/* every dive with a location shares the same pixbuf */
 static GdkPixbuf *get_gps_icon_for_dive(struct dive *dive)
 {
-	if (dive_has_gps_location(dive))
-		return get_gps_icon();
-	else
+	static GdkPixbuf *icon;
+
+	if (!dive_has_gps_location(dive))
 		return NULL;
+	if (!icon)
+		icon = get_gps_icon();
+	return g_object_ref(icon);
 }
 
 /*
@@ -696,12 +700,57 @@ static void clear_trip_indexes(void)
 
 /* Select the iter asked for, and set the keyboard focus on it */
 static void go_to_iter(GtkTreeSelection *selection, GtkTreeIter *iter);
+static void sort_column_change_cb(GtkTreeSortable *treeview, gpointer data);
+
+/*
+ * Inserting rows into a sorted store moves every new row into place
+ * as it is added, so fill both stores unsorted and sort them once at
+ * the end. The sort-column-changed handler must not see these changes.
+ */
+static void suspend_sort(GtkTreeStore *store, int *colid, GtkSortType *order)
+{
+	GtkTreeSortable *sortable = GTK_TREE_SORTABLE(store);
+
+	gtk_tree_sortable_get_sort_column_id(sortable, colid, order);
+	g_signal_handlers_block_by_func(store, sort_column_change_cb, NULL);
+	gtk_tree_sortable_set_sort_column_id(sortable, GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, *order);
+}
+
+static void resume_sort(GtkTreeStore *store, int colid, GtkSortType order)
+{
+	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store), colid, order);
+	g_signal_handlers_unblock_by_func(store, sort_column_change_cb, NULL);
+}
+
+/*
+ * The trip rows are remembered by trip index, which counts from 1. A
+ * dive can be in a trip that isn't on the dive_trip_list, so make room
+ * as the trips come up. NULL if we ran out of memory.
+ */
+static GtkTreeIter *trip_row(GtkTreeIter **trip_iter, int *nr_trips, int index)
+{
+	if (index >= *nr_trips) {
+		int nr = MAX(index + 1, *nr_trips * 2);
+		GtkTreeIter *iters = realloc(*trip_iter, nr * sizeof(GtkTreeIter));
+
+		if (!iters)
+			return NULL;
+		*trip_iter = iters;
+		*nr_trips = nr;
+	}
+	return *trip_iter + index;
+}
+
 static void fill_dive_list(void)
 {
-	int i, trip_index = 0;
-	GtkTreeIter iter, parent_iter, lookup, *parent_ptr = NULL;
+	TRACE_SPAN("fill_dive_list");
+	int i, trip_index = 0, nr_trips = 0;
+	int tree_colid, list_colid;
+	GtkSortType tree_order, list_order;
+	GtkTreeIter iter, *trip_iter = NULL, *parent_ptr;
 	GtkTreeStore *liststore, *treestore;
 	GdkPixbuf *icon;
+	dive_trip_t *trip;
 
 	/* Do we need to create any dive groups automatically? */
 	if (autogroup)
@@ -711,11 +760,18 @@ static void fill_dive_list(void)
 	liststore = LISTSTORE(dive_list);
 
 	clear_trip_indexes();
+	for (i = 0; i < dive_table.nr; i++) {
+		trip = get_dive(i)->divetrip;
+		if (trip)
+			trip->index = 0;
+	}
+
+	suspend_sort(treestore, &tree_colid, &tree_order);
+	suspend_sort(liststore, &list_colid, &list_order);
 
 	i = dive_table.nr;
 	while (--i >= 0) {
 		struct dive *dive = get_dive(i);
-		dive_trip_t *trip;
 		if ((dive->dive_tags & DTAG_INVALID) && !prefs.display_invalid_dives)
 			continue;
 		trip = dive->divetrip;
@@ -723,40 +779,27 @@ static void fill_dive_list(void)
 		if (!trip) {
 			parent_ptr = NULL;
 		} else if (!trip->index) {
-			trip->index = ++trip_index;
-
-			/* Create new trip entry */
-			gtk_tree_store_append(treestore, &parent_iter, NULL);
-			parent_ptr = &parent_iter;
+			/* tree store iters persist, so remember each trip row */
+			parent_ptr = trip_row(&trip_iter, &nr_trips, trip_index + 1);
+			if (parent_ptr) {
+				trip->index = ++trip_index;
 
-			/* a duration of 0 (and negative index) identifies a group */
-			gtk_tree_store_set(treestore, parent_ptr,
+				/* a duration of 0 (and negative index) identifies a group */
+				gtk_tree_store_insert_with_values(treestore, parent_ptr, NULL, -1,
 					DIVE_INDEX, -trip_index,
 					DIVE_DATE, trip->when,
 					DIVE_LOCATION, trip->location,
 					DIVE_DURATION, 0,
 					-1);
-		} else {
-			int idx, ok;
-			GtkTreeModel *model = TREEMODEL(dive_list);
-
-			parent_ptr = NULL;
-			ok = gtk_tree_model_get_iter_first(model, &lookup);
-			while (ok) {
-				gtk_tree_model_get(model, &lookup, DIVE_INDEX, &idx, -1);
-				if (idx == -trip->index) {
-					parent_ptr = &lookup;
-					break;
-				}
-				ok = gtk_tree_model_iter_next(model, &lookup);
 			}
+		} else {
+			parent_ptr = trip_iter + trip->index;
 		}
 
 		/* store dive */
-		update_cylinder_related_info(dive);
-		gtk_tree_store_append(treestore, &iter, parent_ptr);
+		update_dive_metrics(i);
 		icon = get_gps_icon_for_dive(dive);
-		gtk_tree_store_set(treestore, &iter,
+		gtk_tree_store_insert_with_values(treestore, &iter, parent_ptr, -1,
 			DIVE_INDEX, i,
 			DIVE_NR, dive->number,
 			DIVE_DATE, dive->when,
@@ -768,10 +811,7 @@ static void fill_dive_list(void)
 			DIVE_TEMPERATURE, dive->watertemp.mkelvin,
 			DIVE_SAC, 0,
 			-1);
-		if (icon)
-			g_object_unref(icon);
-		gtk_tree_store_append(liststore, &iter, NULL);
-		gtk_tree_store_set(liststore, &iter,
+		gtk_tree_store_insert_with_values(liststore, &iter, NULL, -1,
 			DIVE_INDEX, i,
 			DIVE_NR, dive->number,
 			DIVE_DATE, dive->when,
@@ -785,7 +825,13 @@ static void fill_dive_list(void)
 			DIVE_SUIT, dive->suit,
 			DIVE_SAC, 0,
 			-1);
+		if (icon)
+			g_object_unref(icon);
 	}
+	free(trip_iter);
+
+	resume_sort(treestore, tree_colid, tree_order);
+	resume_sort(liststore, list_colid, list_order);
 
 	update_dive_list_units();
 	if (amount_selected == 0 && gtk_tree_model_get_iter_first(MODEL(dive_list), &iter)) {
@@ -929,7 +975,7 @@ void add_dive_cb(GtkWidget *menuitem, gpointer data)
 		report_dives(TRUE, FALSE);
 		return;
 	}
-	free(dive);
+	dive_free(dive);
 }
 
 static void edit_trip_cb(GtkWidget *menuitem, GtkTreePath *path)
@@ -1449,7 +1495,6 @@ static void upload_dives_divelogs(const gboolean selected)
 		if (!xslt)
 			return;
 		transformed = xsltApplyStylesheet(xslt, doc, NULL);
-		xsltFreeStylesheet(xslt);
 		xmlDocDumpMemory(transformed, (xmlChar **) &membuf, (int *)&streamsize);
 		xmlFreeDoc(doc);
 		xmlFreeDoc(transformed);
@@ -1547,7 +1592,6 @@ static void export_dives_uddf(const gboolean selected)
 		return;
 	}
 	transformed = xsltApplyStylesheet(xslt, doc, NULL);
-	xsltFreeStylesheet(xslt);
 	xmlFreeDoc(doc);
 
 	/* Write the transformed XML to file */
@@ -2249,8 +2293,11 @@ void show_and_select_dive(struct dive *dive)
 		return;
 	iter = get_iter_from_idx(divenr);
 	selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(dive_list.tree_view));
-	for_each_dive(i, odive)
+	for_each_dive(i, odive) {
+		if (odive->selected && odive != dive)
+			pack_dive(odive);
 		odive->selected = FALSE;
+	}
 	amount_selected = 1;
 	selected_dive = divenr;
 	dive->selected = TRUE;
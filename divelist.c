@@ -11,6 +11,8 @@
  * int total_weight(struct dive *dive)
  * int get_divenr(struct dive *dive)
  * double init_decompression(struct dive *dive)
+ * void invalidate_dive_metrics(struct dive *dive)
+ * void update_dive_metrics(int idx)
  * void update_cylinder_related_info(struct dive *dive)
  * void get_location(struct dive *dive, char **str)
  * void get_cylinder(struct dive *dive, char **str)
@@ -31,6 +33,8 @@
  * void mark_divelist_changed(int changed)
  * int unsaved_changes()
  * void remove_autogen_trips()
+ * void sort_table(struct dive_table *table)
+ * void report_dives(gboolean is_imported, gboolean prefer_imported)
  */
 #include <unistd.h>
 #include <stdio.h>
@@ -51,6 +55,8 @@
 #include "divelist.h"
 #include "display.h"
 #include "webservice.h"
+#include "intern.h"
+#include "trace.h"
 
 static short dive_list_changed = FALSE;
 
@@ -58,6 +64,9 @@ dive_trip_t *dive_trip_list;
 
 unsigned int amount_selected;
 
+int selected_dive = 0;
+short autogroup = FALSE;
+
 #if DEBUG_SELECTION_TRACKING
 void dump_selection(void)
 {
@@ -255,48 +264,6 @@ int total_weight(struct dive *dive)
 	return total_grams;
 }
 
-static int active_o2(struct dive *dive, struct divecomputer *dc, duration_t time)
-{
-	int o2permille = dive->cylinder[0].gasmix.o2.permille;
-	struct event *event = dc->events;
-
-	if (!o2permille)
-		o2permille = O2_IN_AIR;
-
-	for (event = dc->events; event; event = event->next) {
-		if (event->time.seconds > time.seconds)
-			break;
-		if (strcmp(event->name, "gaschange"))
-			continue;
-		o2permille = 10*(event->value & 0xffff);
-	}
-	return o2permille;
-}
-
-/* calculate OTU for a dive - this only takes the first divecomputer into account */
-static int calculate_otu(struct dive *dive)
-{
-	int i;
-	double otu = 0.0;
-	struct divecomputer *dc = &dive->dc;
-
-	for (i = 1; i < dc->samples; i++) {
-		int t;
-		int po2;
-		struct sample *sample = dc->sample + i;
-		struct sample *psample = sample - 1;
-		t = sample->time.seconds - psample->time.seconds;
-		if (sample->po2) {
-			po2 = sample->po2;
-		} else {
-			int o2 = active_o2(dive, dc, sample->time);
-			po2 = o2 / 1000.0 * depth_to_mbar(sample->depth.mm, dive);
-		}
-		if (po2 >= 500)
-			otu += pow((po2 - 500) / 1000.0, 0.83) * t / 30.0;
-	}
-	return otu + 0.5;
-}
 /* calculate CNS for a dive - this only takes the first divecomputer into account */
 int const cns_table[][3] = {
 /* po2, Maximum Single Exposure, Maximum 24 hour Exposure */
@@ -313,47 +280,44 @@ int const cns_table[][3] = {
 	{ 600, 720 * 60, 720 * 60}
 };
 
-/* this only gets called if dive->maxcns == 0 which means we know that
- * none of the divecomputers has tracked any CNS for us
- * so we calculated it "by hand" */
-static int calculate_cns(struct dive *dive)
+/*
+ * Calculate OTU and the CNS loading from this dive alone in one pass
+ * over the samples - this only takes the first divecomputer into account.
+ * Any CNS carried over from a previous dive is added by update_dive_metrics()
+ */
+static void calculate_o2_exposure(struct dive *dive, int *otu_p, double *cns_p)
 {
-	int i, j, divenr;
-	double cns = 0.0;
+	int i, j;
+	double otu = 0.0, cns = 0.0;
 	struct divecomputer *dc = &dive->dc;
-	struct dive *prev_dive;
-	timestamp_t endtime;
+	struct gas_cursor gas;
+	struct sample_columns cols;
+	int lasttime;
+	int o2permille = dive->cylinder[0].gasmix.o2.permille;
 
-	/* shortcut */
-	if (dive->cns)
-		return dive->cns;
-	/*
-	 * Do we start with a cns loading from a privious dive?
-	 * Check if we did a dive 12 hours prior, and what cns we had from that.
-	 * Then apply ha 90min halftime to see whats left.
-	 */
-	divenr = get_divenr(dive);
-	if (divenr) {
-		prev_dive = get_dive(divenr -1 );
-		endtime = prev_dive->when + prev_dive->duration.seconds;
-		if (prev_dive && dive->when < (endtime + 3600 * 12)) {
-			cns = calculate_cns(prev_dive);
-			cns = cns * 1/pow(2, (dive->when - endtime) / (90.0 * 60.0));
-		}
-	}
-	/* Caclulate the cns for each sample in this dive and sum them */
-	for (i = 1; i < dc->samples; i++) {
+	*otu_p = 0;
+	*cns_p = 0.0;
+	if (!get_sample_columns(&cols, dc, 1 << COLUMN_TIME | 1 << COLUMN_DEPTH | 1 << COLUMN_PO2))
+		return;
+	if (!o2permille)
+		o2permille = O2_IN_AIR;
+	gas_cursor_init(&gas, dc, o2permille, 0);
+	lasttime = cols.nr ? sample_time(&cols, 0).seconds : 0;
+	for (i = 1; i < cols.nr; i++) {
 		int t;
 		int po2;
-		struct sample *sample = dc->sample + i;
-		struct sample *psample = sample - 1;
-		t = sample->time.seconds - psample->time.seconds;
-		if (sample->po2) {
-			po2 = sample->po2;
+		int time = sample_time(&cols, i).seconds;
+
+		t = time - lasttime;
+		lasttime = time;
+		gas_cursor_advance(&gas, time);
+		if (sample_po2(&cols, i)) {
+			po2 = sample_po2(&cols, i);
 		} else {
-			int o2 = active_o2(dive, dc, sample->time);
-			po2 = o2 / 1000.0 * depth_to_mbar(sample->depth.mm, dive);
+			po2 = gas.o2 / 1000.0 * depth_to_mbar(sample_depth(&cols, i).mm, dive);
 		}
+		if (po2 >= 500)
+			otu += pow((po2 - 500) / 1000.0, 0.83) * t / 30.0;
 		/* Find what table-row we should calculate % for */
 		for (j = 1; j < sizeof(cns_table)/(sizeof(int) * 3); j++)
 			if (po2 > cns_table[j][0])
@@ -361,9 +325,9 @@ static int calculate_cns(struct dive *dive)
 		j--;
 		cns += ((double)t)/((double)cns_table[j][1]) * 100;
 	}
-	/* save calculated cns in dive struct */
-	dive->cns = cns;
-	return dive->cns;
+	free_sample_columns(&cols);
+	*otu_p = otu + 0.5;
+	*cns_p = cns;
 }
 /*
  * Return air usage (in liters).
@@ -416,28 +380,48 @@ static int calculate_sac(struct dive *dive)
 static void add_dive_to_deco(struct dive *dive)
 {
 	struct divecomputer *dc = &dive->dc;
+	struct sample_columns cols;
 	int i;
 
 	if (!dc)
 		return;
-	for (i = 1; i < dc->samples; i++) {
-		struct sample *psample = dc->sample + i - 1;
-		struct sample *sample = dc->sample + i;
-		int t0 = psample->time.seconds;
-		int t1 = sample->time.seconds;
+	if (!get_sample_columns(&cols, dc, 1 << COLUMN_TIME | 1 << COLUMN_DEPTH |
+				1 << COLUMN_PO2 | 1 << COLUMN_SENSOR))
+		return;
+	for (i = 1; i < cols.nr; i++) {
+		int t0 = sample_time(&cols, i - 1).seconds;
+		int t1 = sample_time(&cols, i).seconds;
+		int depth0 = sample_depth(&cols, i - 1).mm;
+		int depth1 = sample_depth(&cols, i).mm;
+		const struct gasmix *gasmix = &dive->cylinder[sample_sensor(&cols, i)].gasmix;
 		int j;
 
 		for (j = t0; j < t1; j++) {
-			int depth = interpolate(psample->depth.mm, sample->depth.mm, j - t0, t1 - t0);
+			int depth = interpolate(depth0, depth1, j - t0, t1 - t0);
 			(void) add_segment(depth_to_mbar(depth, dive) / 1000.0,
-					   &dive->cylinder[sample->sensor].gasmix, 1, sample->po2, dive);
+					   gasmix, 1, sample_po2(&cols, i), dive);
 		}
 	}
+	free_sample_columns(&cols);
 }
 
 int get_divenr(struct dive *dive)
 {
-	int divenr = -1;
+	int lo = 0, hi = dive_table.nr, divenr;
+
+	/* the table is normally sorted by time, so try there first */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (get_dive(mid)->when < dive->when)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (divenr = lo; divenr < dive_table.nr && get_dive(divenr)->when == dive->when; divenr++)
+		if (get_dive(divenr) == dive)
+			return divenr;
+
+	divenr = -1;
 	while (++divenr < dive_table.nr && get_dive(divenr) != dive)
 		;
 	return divenr;
@@ -448,6 +432,7 @@ static struct gasmix air = { .o2.permille = O2_IN_AIR };
 /* take into account previous dives until there is a 48h gap between dives */
 double init_decompression(struct dive *dive)
 {
+	TRACE_SPAN("init_decompression");
 	int i, divenr = -1;
 	unsigned int surface_time;
 	timestamp_t when, lasttime = 0;
@@ -519,13 +504,91 @@ double init_decompression(struct dive *dive)
 	return tissue_tolerance;
 }
 
+/*
+ * SAC, OTU and the CNS loading of a dive only depend on that dive's
+ * samples, cylinders and events, so they are kept until someone tells
+ * us that one of those changed.
+ */
+void invalidate_dive_metrics(struct dive *dive)
+{
+	if (dive)
+		dive->metrics_valid = FALSE;
+}
+
+static void update_own_metrics(struct dive *dive)
+{
+	if (dive->metrics_valid)
+		return;
+	dive->sac = calculate_sac(dive);
+	calculate_o2_exposure(dive, &dive->otu, &dive->cns_exposure);
+	dive->metrics_valid = TRUE;
+}
+
+/* maxcns is only filled in if none of the divecomputers tracked it for us */
+static void set_cns(struct dive *dive, double carried_cns)
+{
+	dive->cns = carried_cns + dive->cns_exposure;
+	if (dive->maxcns == 0 || dive->cns_calculated) {
+		dive->maxcns = dive->cns;
+		dive->cns_calculated = TRUE;
+	}
+}
+
+/* a dive that ended less than 12 hours earlier still contributes CNS */
+static struct dive *cns_predecessor(int idx)
+{
+	struct dive *dive = get_dive(idx);
+	struct dive *prev = get_dive(idx - 1);
+
+	if (!dive || !prev)
+		return NULL;
+	if (dive->when >= prev->when + prev->duration.seconds + 3600 * 12)
+		return NULL;
+	return prev;
+}
+
+/*
+ * The carried over CNS is cheap to calculate, so rather than tracking
+ * which dives depend on which, walk back to the first dive of the series
+ * and apply the 90min halftime forward from there. That way changes to
+ * any earlier dive (or to the dive table itself) are always picked up.
+ */
+void update_dive_metrics(int idx)
+{
+	int i, start = idx;
+	struct dive *dive = get_dive(idx);
+
+	if (!dive)
+		return;
+	while (cns_predecessor(start))
+		start--;
+	for (i = start; i <= idx; i++) {
+		struct dive *prev = i > start ? get_dive(i - 1) : NULL;
+		double cns = 0.0;
+
+		dive = get_dive(i);
+		update_own_metrics(dive);
+		if (prev) {
+			timestamp_t endtime = prev->when + prev->duration.seconds;
+			cns = prev->cns * 1/pow(2, (dive->when - endtime) / (90.0 * 60.0));
+		}
+		set_cns(dive, cns);
+	}
+}
+
 void update_cylinder_related_info(struct dive *dive)
 {
+	int divenr;
+
 	if (dive != NULL) {
-		dive->sac = calculate_sac(dive);
-		dive->otu = calculate_otu(dive);
-		if (dive->maxcns == 0)
-			dive->maxcns = calculate_cns(dive);
+		invalidate_dive_metrics(dive);
+		divenr = get_divenr(dive);
+		if (divenr < dive_table.nr) {
+			update_dive_metrics(divenr);
+		} else {
+			update_own_metrics(dive);
+			set_cns(dive, 0.0);
+		}
 	}
 }
 
@@ -663,8 +726,7 @@ static void delete_trip(dive_trip_t *trip)
 	}
 
 	/* .. and free it */
-	if (trip->location)
-		free(trip->location);
+	dive_free(trip->location);
 	if (trip->notes)
 		free(trip->notes);
 	free(trip);
@@ -732,7 +794,7 @@ dive_trip_t *create_and_hookup_trip_from_dive(struct dive *dive)
 	dive_trip_t *dive_trip = calloc(sizeof(dive_trip_t),1);
 	dive_trip->when = dive->when;
 	if (dive->location)
-		dive_trip->location = strdup(dive->location);
+		dive_trip->location = (char *) intern_string(dive->location);
 	insert_trip(&dive_trip);
 
 	dive->tripflag = IN_TRIP;
@@ -766,7 +828,7 @@ void autogroup_dives(void)
 			dive_trip_t *trip = lastdive->divetrip;
 			add_dive_to_trip(dive, trip);
 			if (dive->location && !trip->location)
-				trip->location = strdup(dive->location);
+				trip->location = (char *) intern_string(dive->location);
 			lastdive = dive;
 			continue;
 		}
@@ -803,19 +865,7 @@ void delete_single_dive(int idx)
 	dive_table.dives[--dive_table.nr] = NULL;
 	if (dive->selected)
 		amount_selected--;
-	/* free all allocations */
-	free(dive->dc.sample);
-	if (dive->location)
-		free((void *)dive->location);
-	if (dive->notes)
-		free((void *)dive->notes);
-	if (dive->divemaster)
-		free((void *)dive->divemaster);
-	if (dive->buddy)
-		free((void *)dive->buddy);
-	if (dive->suit)
-		free((void *)dive->suit);
-	free(dive);
+	free_dive(dive);
 }
 
 void add_single_dive(int idx, struct dive *dive)
@@ -864,6 +914,7 @@ void deselect_dive(int idx)
 	if (dive && dive->selected) {
 		dive->selected = 0;
 		amount_selected--;
+		pack_dive(dive);
 		if (selected_dive == idx && amount_selected > 0) {
 			/* pick a different dive as selected */
 			while (--selected_dive >= 0) {
@@ -906,3 +957,147 @@ void remove_autogen_trips()
 	}
 }
 
+static int sortfn(const void *_a, const void *_b)
+{
+	const struct dive *a = *(void **)_a;
+	const struct dive *b = *(void **)_b;
+
+	if (a->when < b->when)
+		return -1;
+	if (a->when > b->when)
+		return 1;
+	return 0;
+}
+
+void sort_table(struct dive_table *table)
+{
+	qsort(table->dives, table->nr, sizeof(struct dive *), sortfn);
+}
+
+/*
+ * When adding dives to the dive table, we try to renumber
+ * the new dives based on any old dives in the dive table.
+ *
+ * But we only do it if:
+ *
+ *  - there are no dives in the dive table
+ *
+ *  OR
+ *
+ *  - the last dive in the old dive table was numbered
+ *
+ *  - all the new dives are strictly at the end (so the
+ *    "last dive" is at the same location in the dive table
+ *    after re-sorting the dives.
+ *
+ *  - none of the new dives have any numbers
+ *
+ * This catches the common case of importing new dives from
+ * a dive computer, and gives them proper numbers based on
+ * your old dive list. But it tries to be very conservative
+ * and not give numbers if there is *any* question about
+ * what the numbers should be - in which case you need to do
+ * a manual re-numbering.
+ */
+static void try_to_renumber(struct dive *last, int preexisting)
+{
+	int i, nr;
+
+	/*
+	 * If the new dives aren't all strictly at the end,
+	 * we're going to expect the user to do a manual
+	 * renumbering.
+	 */
+	if (preexisting && get_dive(preexisting-1) != last)
+		return;
+
+	/*
+	 * If any of the new dives already had a number,
+	 * we'll have to do a manual renumbering.
+	 */
+	for (i = preexisting; i < dive_table.nr; i++) {
+		struct dive *dive = get_dive(i);
+		if (dive->number)
+			return;
+	}
+
+	/*
+	 * Ok, renumber..
+	 */
+	if (last)
+		nr = last->number;
+	else
+		nr = 0;
+	for (i = preexisting; i < dive_table.nr; i++) {
+		struct dive *dive = get_dive(i);
+		dive->number = ++nr;
+	}
+}
+
+/*
+ * This doesn't really report anything at all. We just sort the
+ * dives, the GUI does the reporting
+ */
+void report_dives(gboolean is_imported, gboolean prefer_imported)
+{
+	TRACE_SPAN("report_dives");
+	int i;
+	int preexisting = dive_table.preexisting;
+	struct dive *last;
+
+	/* check if we need a nickname for the divecomputer for newly downloaded dives;
+	 * since we know they all came from the same divecomputer we just check for the
+	 * first one */
+	if (preexisting < dive_table.nr && dive_table.dives[preexisting]->downloaded)
+		set_dc_nickname(dive_table.dives[preexisting]);
+	else
+		/* they aren't downloaded, so record / check all new ones */
+		for (i = preexisting; i < dive_table.nr; i++)
+			set_dc_nickname(dive_table.dives[i]);
+
+	/* This does the right thing for -1: NULL */
+	last = get_dive(preexisting-1);
+
+	sort_table(&dive_table);
+
+	for (i = 1; i < dive_table.nr; i++) {
+		struct dive **pp = &dive_table.dives[i-1];
+		struct dive *prev = pp[0];
+		struct dive *dive = pp[1];
+		struct dive *merged;
+
+		/* only try to merge overlapping dives - or if one of the dives has
+		 * zero duration (that might be a gps marker from the webservice) */
+		if (prev->duration.seconds && dive->duration.seconds &&
+		    prev->when + prev->duration.seconds < dive->when)
+			continue;
+
+		merged = try_to_merge(prev, dive, prefer_imported);
+		if (!merged)
+			continue;
+
+		/* careful - we might free the dive that last points to. Oops... */
+		if (last == prev || last == dive)
+			last = merged;
+
+		/* Redo the new 'i'th dive */
+		i--;
+		add_single_dive(i, merged);
+		delete_single_dive(i+1);
+		delete_single_dive(i+1);
+	}
+	/* make sure no dives are still marked as downloaded */
+	for (i = 1; i < dive_table.nr; i++)
+		dive_table.dives[i]->downloaded = FALSE;
+
+	if (is_imported) {
+		/* If there are dives in the table, are they numbered */
+		if (!last || last->number)
+			try_to_renumber(last, preexisting);
+
+		/* did we add dives to the dive table? */
+		if (preexisting != dive_table.nr)
+			mark_divelist_changed(TRUE);
+	}
+	dive_list_update_dives();
+}
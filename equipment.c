@@ -18,6 +18,7 @@
 #include "display.h"
 #include "display-gtk.h"
 #include "divelist.h"
+#include "intern.h"
 
 static GtkListStore *cylinder_model, *weightsystem_model;
 
@@ -451,29 +452,6 @@ static void show_weightsystem(weightsystem_t *ws, struct ws_widget *weightsystem
 	set_weight_weight_spinbutton(weightsystem_widget, ws->weight.grams);
 }
 
-gboolean cylinder_nodata(cylinder_t *cyl)
-{
-	return	!cyl->type.size.mliter &&
-		!cyl->type.workingpressure.mbar &&
-		!cyl->type.description &&
-		!cyl->gasmix.o2.permille &&
-		!cyl->gasmix.he.permille &&
-		!cyl->start.mbar &&
-		!cyl->end.mbar;
-}
-
-static gboolean cylinder_nosamples(cylinder_t *cyl)
-{
-	return	!cyl->sample_start.mbar &&
-		!cyl->sample_end.mbar;
-}
-
-gboolean cylinder_none(void *_data)
-{
-	cylinder_t *cyl = _data;
-	return cylinder_nodata(cyl) && cylinder_nosamples(cyl);
-}
-
 /* descriptions are equal if they are both NULL or both non-NULL
    and the same text */
 static gboolean description_equal(const char *desc1, const char *desc2)
@@ -739,7 +717,7 @@ static void record_cylinder_changes(cylinder_t *cyl, struct cylinder_widget *cyl
 	if (!box)
 		return;
 
-	desc = strdup(get_active_text(box));
+	desc = intern_string(get_active_text(box));
 	volume = gtk_spin_button_get_value(cylinder->size);
 	pressure = gtk_spin_button_get_value(cylinder->pressure);
 	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(cylinder->pressure_button))) {
@@ -771,7 +749,7 @@ static void record_weightsystem_changes(weightsystem_t *ws, struct ws_widget *we
 	if (!box)
 		return;
 
-	desc = strdup(get_active_text(box));
+	desc = intern_string(get_active_text(box));
 	value = gtk_spin_button_get_value(weightsystem_widget->weight);
 
 	if (prefs.units.weight == LBS)
@@ -1,6 +1,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -8,12 +11,54 @@
 
 #include "dive.h"
 #include "file.h"
+#include "trace.h"
 
 /* Crazy windows sh*t */
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
+/*
+ * Map the file if we can: the parsers then work on the page cache
+ * directly instead of a copy of the file. They all want the buffer to
+ * be NUL terminated, which the zero fill after the end of the file
+ * gives us - unless the file ends exactly at a page boundary.
+ *
+ * The mapping is private and read-only, so the buffer must not be
+ * modified, and free_memblock() has to be used to release it.
+ */
+static int mapfile(int fd, struct stat *st, struct memblock *mem)
+{
+#ifndef WIN32
+	void *map;
+
+	if (!(st->st_size % sysconf(_SC_PAGESIZE)))
+		return 0;
+	map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+	mem->buffer = map;
+	mem->size = st->st_size;
+	mem->mapped = TRUE;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void free_memblock(struct memblock *mem)
+{
+#ifndef WIN32
+	if (mem->mapped)
+		munmap(mem->buffer, mem->size);
+	else
+#endif
+		free(mem->buffer);
+	mem->buffer = NULL;
+	mem->size = 0;
+	mem->mapped = FALSE;
+}
+
 int readfile(const char *filename, struct memblock *mem)
 {
 	int ret, fd;
@@ -22,6 +67,7 @@ int readfile(const char *filename, struct memblock *mem)
 
 	mem->buffer = NULL;
 	mem->size = 0;
+	mem->mapped = FALSE;
 
 	fd = g_open(filename, O_RDONLY | O_BINARY, 0);
 	if (fd < 0)
@@ -35,6 +81,9 @@ int readfile(const char *filename, struct memblock *mem)
 	ret = 0;
 	if (!st.st_size)
 		goto out;
+	ret = st.st_size;
+	if (mapfile(fd, &st, mem))
+		goto out;
 	buf = malloc(st.st_size+1);
 	ret = -1;
 	errno = ENOMEM;
@@ -60,46 +109,210 @@ out:
 }
 
 #ifdef LIBZIP
+#include <pthread.h>
 #include <zip.h>
 
-static void zip_read(struct zip_file *file, GError **error, const char *filename)
-{
-	int size = 1024, n, read = 0;
-	char *mem = malloc(size);
+/*
+ * The zip members go straight from the decompressor into the XML
+ * parser, a chunk at a time, without the whole member ever being in
+ * memory. The divelogs.de ones are the exception, they are small and
+ * preprocess_divelog_de() wants them in one piece.
+ */
+struct zip_stream {
+	struct zip_file *file;
+	const char *head;
+	int headlen;
+};
 
-	while ((n = zip_fread(file, mem+read, size-read)) > 0) {
-		read += n;
-		size = read * 3 / 2;
-		mem = realloc(mem, size);
+static int zip_stream_read(void *_stream, char *buffer, int len)
+{
+	struct zip_stream *stream = _stream;
+
+	if (stream->headlen) {
+		len = MIN(len, stream->headlen);
+		memcpy(buffer, stream->head, len);
+		stream->head += len;
+		stream->headlen -= len;
+		return len;
 	}
-	mem[read] = 0;
-	parse_xml_buffer(filename, mem, read, &dive_table, error);
+	return zip_fread(stream->file, buffer, len);
+}
+
+static xmlDoc *zip_read(struct zip *zip, int index, struct zip_file *file, GError **error, const char *filename)
+{
+	char head[1024];
+	struct zip_stat st;
+	struct zip_stream stream = { file, head };
+	int n = zip_fread(file, head, sizeof(head));
+	long len;
+	char *mem;
+	xmlDoc *doc;
+
+	if (n <= 0)
+		return NULL;
+	stream.headlen = n;
+	if (!g_strstr_len(head, n, "<DIVELOGSDATA>") || zip_stat_index(zip, index, 0, &st) < 0)
+		return load_xml_io(filename, zip_stream_read, &stream, error);
+
+	mem = malloc(MAX(st.size, n) + 1);
+	if (!mem)
+		return NULL;
+	memcpy(mem, head, n);
+	while (n < st.size && (len = zip_fread(file, mem + n, st.size - n)) > 0)
+		n += len;
+	mem[n] = 0;
+	doc = load_xml_buffer(filename, mem, n, error);
 	free(mem);
+	return doc;
+}
+
+/*
+ * SDE and DLD archives have a member per dive, so a whole logbook
+ * is thousands of small ones. A few threads decompress, parse and
+ * transform them, while we turn them into dives in the order of the
+ * archive. The threads stay at most ZIP_QUEUE members ahead of us.
+ */
+#define ZIP_THREADS 4
+#define ZIP_QUEUE 32
+
+struct zip_member {
+	xmlDoc *doc;
+	GError *error;
+	gboolean opened, loaded;
+};
+
+struct zip_import {
+	const char *filename;
+	int nr, next, parsed;
+	struct zip_member *members;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void zip_load(struct zip *zip, int index, const char *filename, struct zip_member *member)
+{
+	struct zip_file *file = zip_fopen_index(zip, index, 0);
+
+	if (file) {
+		member->doc = zip_read(zip, index, file, &member->error, filename);
+		member->opened = TRUE;
+		zip_fclose(file);
+	}
+}
+
+static void *zip_thread(void *_import)
+{
+	struct zip_import *import = _import;
+	/* a libzip handle can't be shared between threads */
+	struct zip *zip = zip_open(import->filename, 0, NULL);
+
+	join_import();
+	for (;;) {
+		struct zip_member member = { NULL };
+		int i;
+
+		pthread_mutex_lock(&import->lock);
+		while (import->next < import->nr && import->next - import->parsed >= ZIP_QUEUE)
+			pthread_cond_wait(&import->cond, &import->lock);
+		i = import->next++;
+		pthread_mutex_unlock(&import->lock);
+		if (i >= import->nr)
+			break;
+
+		if (zip)
+			zip_load(zip, i, import->filename, &member);
+		member.loaded = TRUE;
+
+		pthread_mutex_lock(&import->lock);
+		import->members[i] = member;
+		pthread_cond_broadcast(&import->cond);
+		pthread_mutex_unlock(&import->lock);
+	}
+	if (zip)
+		zip_close(zip);
+	leave_import();
+	return NULL;
 }
+
+/* the threads only get in each other's way on a single processor */
+static int zip_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus > 0)
+		return cpus > 1 ? MIN(cpus, ZIP_THREADS) : 0;
 #endif
+	return ZIP_THREADS;
+}
 
 static int try_to_open_zip(const char *filename, struct memblock *mem, GError **error)
 {
 	int success = 0;
-#ifdef LIBZIP
 	/* Grr. libzip needs to re-open the file, it can't take a buffer */
 	struct zip *zip = zip_open(filename, ZIP_CHECKCONS, NULL);
+	struct zip_import import = { filename };
+	pthread_t threads[ZIP_THREADS];
+	int i, nr_threads = zip_threads(), started = 0;
 
-	if (zip) {
-		int index;
-		for (index = 0; ;index++) {
-			struct zip_file *file = zip_fopen_index(zip, index, 0);
-			if (!file)
-				break;
-			zip_read(file, error, filename);
-			zip_fclose(file);
-			success++;
-		}
+	if (!zip)
+		return 0;
+	import.nr = zip_get_num_entries(zip, 0);
+	import.members = calloc(MAX(import.nr, 1), sizeof(struct zip_member));
+	if (!import.members) {
 		zip_close(zip);
+		return 0;
 	}
-#endif
+	pthread_mutex_init(&import.lock, NULL);
+	pthread_cond_init(&import.cond, NULL);
+	for (i = 0; i < nr_threads && i < import.nr - 1; i++) {
+		if (pthread_create(threads + started, NULL, zip_thread, &import))
+			break;
+		started++;
+	}
+
+	for (i = 0; i < import.nr; i++) {
+		struct zip_member *member = import.members + i;
+
+		/* without the threads we load them ourselves */
+		if (!started) {
+			zip_load(zip, i, filename, member);
+		} else {
+			pthread_mutex_lock(&import.lock);
+			while (!member->loaded)
+				pthread_cond_wait(&import.cond, &import.lock);
+			pthread_mutex_unlock(&import.lock);
+		}
+
+		parse_xml_doc(member->doc, &dive_table);
+		if (member->error) {
+			if (error && !*error)
+				*error = member->error;
+			else
+				g_error_free(member->error);
+		}
+		success += member->opened;
+
+		pthread_mutex_lock(&import.lock);
+		import.parsed = i + 1;
+		pthread_cond_broadcast(&import.cond);
+		pthread_mutex_unlock(&import.lock);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&import.cond);
+	pthread_mutex_destroy(&import.lock);
+	free(import.members);
+	zip_close(zip);
 	return success;
 }
+#else
+static int try_to_open_zip(const char *filename, struct memblock *mem, GError **error)
+{
+	return 0;
+}
+#endif
 
 #ifdef SQLITE3
 static int try_to_open_db(const char *filename, struct memblock *mem, GError **error)
@@ -141,9 +354,12 @@ static timestamp_t parse_date(const char *date)
 }
 
 enum csv_format {
-	CSV_DEPTH, CSV_TEMP, CSV_PRESSURE
+	CSV_DEPTH, CSV_TEMP, CSV_PRESSURE, CSV_FORMATS
 };
 
+/* the extensions of the files, in the order of the formats */
+static const char csv_suffix[CSV_FORMATS][4] = { "DPT", "TMP", "HP1" };
+
 static void add_sample_data(struct sample *sample, enum csv_format type, double val)
 {
 	switch (type) {
@@ -156,6 +372,8 @@ static void add_sample_data(struct sample *sample, enum csv_format type, double
 	case CSV_PRESSURE:
 		sample->cylinderpressure.mbar = psi_to_mbar(val*4);
 		break;
+	default:
+		break;
 	}
 }
 
@@ -173,58 +391,163 @@ static void add_sample_data(struct sample *sample, enum csv_format type, double
  *   computer??: {GeminiII},{CommanderIII}
  *   ??: 1
  *
- * Followed by the data values (all comma-separated, all one long line).
+ * Followed by the data values (all comma-separated, all one long line),
+ * one per second.
+ *
+ * The depth, temperature and pressure of a dive are in three files that
+ * only differ in the extension. They are read together, a value from
+ * each per sample, into one dive.
  */
-static int try_to_open_csv(const char *filename, struct memblock *mem, enum csv_format type)
-{
-	char *p = mem->buffer;
-	char *header[8];
-	int i, time;
+struct csv_column {
+	struct memblock mem;
+	const char *p, *end;
 	timestamp_t date;
-	struct dive *dive;
-	struct divecomputer *dc;
+	int number;
+};
 
+static gboolean csv_header(struct csv_column *col)
+{
+	const char *p = col->mem.buffer;
+	const char *header[8];
+	int i;
+
+	if (!p)
+		return FALSE;
+	col->end = p + col->mem.size;
 	for (i = 0; i < 8; i++) {
 		header[i] = p;
-		p = strchr(p, ',');
+		p = memchr(p, ',', col->end - p);
 		if (!p)
-			return 0;
+			return FALSE;
 		p++;
 	}
+	col->p = p;
+	col->date = parse_date(header[2]);
+	col->number = atoi(header[1]);
+	return col->date != 0;
+}
 
-	date = parse_date(header[2]);
-	if (!date)
+/* the next value of the column, FALSE once it has run out */
+static gboolean csv_next_value(struct csv_column *col, double *val)
+{
+	char *end;
+
+	if (col->p >= col->end)
+		return FALSE;
+	errno = 0;
+	*val = g_ascii_strtod(col->p, &end);
+	if (end == col->p || errno) {
+		col->p = col->end;
+		return FALSE;
+	}
+	col->p = *end == ',' ? end + 1 : col->end;
+	return TRUE;
+}
+
+/* from the length of the first few values */
+static int csv_estimate_samples(struct csv_column *col)
+{
+	const char *p = col->p;
+	int n;
+
+	for (n = 0; n < 64 && p < col->end; n++) {
+		p = memchr(p, ',', col->end - p);
+		if (!p)
+			return n + 1;
+		p++;
+	}
+	if (p <= col->p)
 		return 0;
+	return (long long) (col->end - col->p) * n / (p - col->p) + 1;
+}
+
+/* "T036785.dpt" for "T036785.DPT", in the same case */
+static char *csv_companion(const char *filename, enum csv_format type)
+{
+	const char *ext = strrchr(filename, '.') + 1;
+	char *name = strdup(filename);
+	int i;
+
+	if (!name)
+		return NULL;
+	for (i = 0; i < 3; i++)
+		name[ext - filename + i] = g_ascii_isupper(ext[0]) ?
+			csv_suffix[type][i] : g_ascii_tolower(csv_suffix[type][i]);
+	return name;
+}
+
+/* opening several of the files of a dive imports it only once */
+static gboolean csv_dive_imported(timestamp_t date, int number)
+{
+	int i;
+
+	for (i = dive_table.preexisting; i < dive_table.nr; i++) {
+		struct dive *dive = dive_table.dives[i];
+
+		if (dive->when == date && dive->number == number)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int try_to_open_csv(const char *filename, struct memblock *mem, enum csv_format type)
+{
+	struct csv_column col[CSV_FORMATS] = { { { NULL } } };
+	struct dive *dive;
+	struct divecomputer *dc;
+	int i, nr = 0, time;
+
+	col[type].mem = *mem;
+	if (!csv_header(col + type))
+		return 0;
+	if (csv_dive_imported(col[type].date, col[type].number))
+		return 1;
+
+	for (i = 0; i < CSV_FORMATS; i++) {
+		char *name;
+
+		if (i == type)
+			continue;
+		name = csv_companion(filename, i);
+		if (name && readfile(name, &col[i].mem) > 0 && csv_header(col + i) &&
+		    col[i].date == col[type].date)
+			nr = MAX(nr, csv_estimate_samples(col + i));
+		else
+			col[i].p = col[i].end = NULL;
+		free(name);
+	}
 
 	dive = alloc_dive();
-	dive->when = date;
-	dive->number = atoi(header[1]);
+	dive->when = col[type].date;
+	dive->number = col[type].number;
 	dc = &dive->dc;
+	reserve_samples(dc, MAX(nr, csv_estimate_samples(col + type)));
 
-	time = 0;
-	for (;;) {
-		char *end;
-		double val;
-		struct sample *sample;
+	for (time = 0; ; time++) {
+		struct sample *sample = prepare_sample(dc);
+		gboolean found = FALSE;
 
-		errno = 0;
-		val = g_ascii_strtod(p,&end);
-		if (end == p)
-			break;
-		if (errno)
+		if (!sample)
 			break;
+		for (i = 0; i < CSV_FORMATS; i++) {
+			double val;
 
-		sample = prepare_sample(dc);
+			if (csv_next_value(col + i, &val)) {
+				add_sample_data(sample, i, val);
+				found = TRUE;
+			}
+		}
+		if (!found)
+			break;
 		sample->time.seconds = time;
-		add_sample_data(sample, type, val);
 		finish_sample(dc);
-
-		time++;
-		dc->duration.seconds = time;
-		if (*end != ',')
-			break;
-		p = end+1;
 	}
+	dc->duration.seconds = time;
+
+	/* ours is the caller's */
+	for (i = 0; i < CSV_FORMATS; i++)
+		if (i != type)
+			free_memblock(&col[i].mem);
 	record_dive(dive);
 	return 1;
 }
@@ -265,6 +588,7 @@ static void parse_file_buffer(const char *filename, struct memblock *mem, GError
 
 void parse_file(const char *filename, GError **error)
 {
+	TRACE_SPAN("parse_file");
 	struct memblock mem;
 #ifdef SQLITE3
 	char *fmt;
@@ -286,16 +610,19 @@ void parse_file(const char *filename, GError **error)
 		return;
 	}
 
+	begin_import();
 #ifdef SQLITE3
 	fmt = strrchr(filename, '.');
 	if (fmt && (!strcasecmp(fmt + 1, "DB") || !strcasecmp(fmt + 1, "BAK"))) {
 		if (!try_to_open_db(filename, &mem, error)) {
-			free(mem.buffer);
+			end_import();
+			free_memblock(&mem);
 			return;
 		}
 	}
 #endif
 
 	parse_file_buffer(filename, &mem, error);
-	free(mem.buffer);
+	end_import();
+	free_memblock(&mem);
 }
@@ -4,9 +4,11 @@
 struct memblock {
 	void *buffer;
 	size_t size;
+	gboolean mapped;
 };
 
 extern int try_to_open_cochran(const char *filename, struct memblock *mem, GError **error);
 extern int readfile(const char *filename, struct memblock *mem);
+extern void free_memblock(struct memblock *mem);
 
 #endif
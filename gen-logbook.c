@@ -0,0 +1,36 @@
+/* gen-logbook.c */
+/* writes a synthetic logbook in the Subsurface XML format
+ *
+ * This is for testing the load, save, merge, statistics and profile
+ * code with logbooks that are much larger than the ones in dives/.
+ * The same options and seed always create the same file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dive.h"
+#include "synthetic.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s " SYNTHETIC_USAGE " output.xml\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	struct synthetic_options options = default_synthetic_options;
+
+	for (i = 1; i < argc - 1 && argv[i][0] == '-'; i += 2) {
+		if (!parse_synthetic_option(&options, argv[i][1], argv[i + 1]))
+			usage(argv[0]);
+	}
+	if (i != argc - 1 || argv[i][0] == '-')
+		usage(argv[0]);
+
+	prefs = default_prefs;
+	synthesize_dives(&options);
+	save_dives(argv[i]);
+	return 0;
+}
@@ -270,6 +270,7 @@ static void file_close(GtkWidget *w, gpointer data)
 	/* free the dives and trips */
 	while (dive_table.nr)
 		delete_single_dive(0);
+	free_import_arenas();
 	mark_divelist_changed(FALSE);
 
 	/* clear the selection and the statistics */
@@ -1865,12 +1866,15 @@ typedef struct {
 } tooltip_record_t;
 
 static tooltip_record_t *tooltip_rects;
-static int tooltips;
+static int tooltips, tooltips_allocated;
 
 void attach_tooltip(int x, int y, int w, int h, const char *text, struct event *event)
 {
 	cairo_rectangle_t *rect;
-	tooltip_rects = realloc(tooltip_rects, (tooltips + 1) * sizeof(tooltip_record_t));
+	if (tooltips == tooltips_allocated) {
+		tooltips_allocated = tooltips_allocated * 2 + 16;
+		tooltip_rects = realloc(tooltip_rects, tooltips_allocated * sizeof(tooltip_record_t));
+	}
 	rect = &tooltip_rects[tooltips].rect;
 	rect->x = x;
 	rect->y = y;
@@ -1885,6 +1889,26 @@ void attach_tooltip(int x, int y, int w, int h, const char *text, struct event *
 				(_r.y <= _y) && (_r.y + _r.height >= _y))
 #define INSIDE_RECT_X(_r, _x)   ((_r.x <= _x) && (_r.x + _r.width >= _x))
 
+/*
+ * The event markers are attached in time order and all have the same
+ * width, so the rectangles are sorted by x: find the first one that
+ * doesn't end left of x and only look at the ones from there on.
+ */
+static int first_tooltip_at(int x)
+{
+	int lo = 0, hi = tooltips;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		cairo_rectangle_t *rect = &tooltip_rects[mid].rect;
+		if (rect->x + rect->width < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 static gboolean profile_tooltip (GtkWidget *widget, gint x, gint y,
 			gboolean keyboard_mode, GtkTooltip *tooltip, struct graphics_context *gc)
 {
@@ -1914,7 +1938,7 @@ static gboolean profile_tooltip (GtkWidget *widget, gint x, gint y,
 	time = (tx * gc->maxtime) / width;
 
 	/* are we over an event marker ? */
-	for (i = 0; i < tooltips; i++) {
+	for (i = first_tooltip_at(tx); i < tooltips && tooltip_rects[i].rect.x <= tx; i++) {
 		if (INSIDE_RECT(tooltip_rects[i].rect, tx, ty)) {
 			event = tooltip_rects[i].text;
 			break;
@@ -1962,7 +1986,7 @@ static void common_drawing_function(GtkWidget *widget, struct graphics_context *
 			free(tooltip_rects);
 			tooltip_rects = NULL;
 		}
-		tooltips = 0;
+		tooltips = tooltips_allocated = 0;
 		plot(gc, dive, SC_SCREEN);
 	}
 }
@@ -2043,6 +2067,7 @@ static void add_gas_change_cb(GtkWidget *menuitem, gpointer data)
 		cylinder_t *cyl = &current_dive->cylinder[cylnr];
 		int value = cyl->gasmix.o2.permille / 10 | ((cyl->gasmix.he.permille / 10) << 16);
 		add_event(current_dc, when, 25, 0, value, "gaschange");
+		invalidate_dive_metrics(current_dive);
 		mark_divelist_changed(TRUE);
 		report_dives(FALSE, FALSE);
 		dive_list_update_dives();
@@ -2093,7 +2118,7 @@ static struct event *event_at_x(double rel_x)
 	int i;
 	int x = x_abs(rel_x);
 
-	for (i = 0; i < tooltips; i++) {
+	for (i = first_tooltip_at(x); i < tooltips && tooltip_rects[i].rect.x <= x; i++) {
 		if (INSIDE_RECT_X(tooltip_rects[i].rect, x)) {
 			ret = tooltip_rects[i].event;
 			break;
@@ -2111,8 +2136,9 @@ static void remove_event_cb(GtkWidget *menuitem, gpointer data)
 			ep = &(*ep)->next;
 		if (ep) {
 			*ep = event->next;
-			free(event);
+			dive_free(event);
 		}
+		invalidate_dive_metrics(current_dive);
 		mark_divelist_changed(TRUE);
 		report_dives(FALSE, FALSE);
 	}
@@ -19,6 +19,7 @@
 #include "display.h"
 #include "display-gtk.h"
 #include "divelist.h"
+#include "intern.h"
 
 typedef enum { EDIT_NEW_DIVE, EDIT_ALL, EDIT_WHEN } edit_control_t;
 static GtkEntry *location, *buddy, *divemaster, *rating, *suit;
@@ -89,8 +90,8 @@ static char *get_combo_box_entry_text(GtkComboBox *combo_box, char **textp, cons
 		return NULL;
 	if (!text_changed(old,new))
 		return NULL;
-	free(old);
-	*textp = strdup(new);
+	dive_free(old);
+	*textp = (char *) intern_string(new);
 	return *textp;
 }
 
@@ -1020,12 +1021,11 @@ static void copy_type(cylinder_t *dst, cylinder_t *src)
 {
 	dst->type.size = src->type.size;
 	dst->type.workingpressure = src->type.workingpressure;
-	if (dst->type.description)
-		free((void *)dst->type.description);
+	dive_free((void *)dst->type.description);
 	if (!src->type.description || !*src->type.description)
 		dst->type.description = NULL;
 	else
-		dst->type.description = strdup((char *)src->type.description);
+		dst->type.description = intern_string(src->type.description);
 }
 
 static int same_gasmix(cylinder_t *dst, cylinder_t *src)
@@ -0,0 +1,52 @@
+/* intern.c */
+/* the pool of shared metadata strings, see intern.h */
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "arena.h"
+#include "intern.h"
+
+/* the downloads run in their own thread */
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *strings;
+static struct arena string_arena;
+
+const char *intern_string(const char *str)
+{
+	char *res;
+
+	if (!str)
+		return str;
+
+	pthread_mutex_lock(&intern_lock);
+	if (arena_owns(&string_arena, str)) {
+		pthread_mutex_unlock(&intern_lock);
+		return str;
+	}
+	if (!strings)
+		strings = g_hash_table_new(g_str_hash, g_str_equal);
+	res = g_hash_table_lookup(strings, str);
+	if (!res) {
+		size_t len = strlen(str) + 1;
+
+		res = arena_alloc(&string_arena, len);
+		memcpy(res, str, len);
+		g_hash_table_insert(strings, res, res);
+	}
+	pthread_mutex_unlock(&intern_lock);
+	return res;
+}
+
+/* the download thread may be adding a chunk to the arena meanwhile */
+gboolean is_interned(const void *ptr)
+{
+	gboolean owned;
+
+	if (!ptr)
+		return FALSE;
+	pthread_mutex_lock(&intern_lock);
+	owned = arena_owns(&string_arena, ptr);
+	pthread_mutex_unlock(&intern_lock);
+	return owned;
+}
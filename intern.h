@@ -0,0 +1,14 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+/*
+ * One shared copy of each of the strings that repeat from dive to dive:
+ * locations, buddies, divemasters, suits, dive computer models and
+ * cylinder and weight system descriptions. Interned strings live until
+ * the program exits - never free() them, dive_free() knows to skip them.
+ * Two interned strings are equal exactly when the pointers are.
+ */
+extern const char *intern_string(const char *str);
+extern gboolean is_interned(const void *ptr);
+
+#endif
@@ -9,10 +9,24 @@
 #include "divelist.h"
 #include "display.h"
 #include "display-gtk.h"
+#include "intern.h"
+#include "replay.h"
 
 #include "libdivecomputer.h"
 #include "libdivecomputer/version.h"
 
+/* the parsers of the different families, for replays without a device */
+#include <libdivecomputer/suunto.h>
+#include <libdivecomputer/reefnet.h>
+#include <libdivecomputer/uwatec.h>
+#include <libdivecomputer/oceanic.h>
+#include <libdivecomputer/mares.h>
+#include <libdivecomputer/hw.h>
+#include <libdivecomputer/cressi.h>
+#include <libdivecomputer/zeagle.h>
+#include <libdivecomputer/atomics.h>
+#include <libdivecomputer/shearwater.h>
+
 /* Christ. Libdivecomputer has the worst configuration system ever. */
 #ifdef HW_FROG_H
   #define NOT_FROG , 0
@@ -39,8 +53,81 @@ static GError *error(const char *fmt, ...)
 	return error;
 }
 
+/* what the device told us about itself, for the replay parsers */
+static unsigned int devinfo_model, clock_devtime;
+static dc_ticks_t clock_systime;
+
+/*
+ * dc_parser_new() wants the device, which a replay doesn't have. So
+ * this does what it does, with the device information and the clock
+ * from the replay file. It has to know every family dc_parser_new()
+ * knows: the recording names the family its parser came from, and
+ * replay_foreach() checks that we can create one before the dives.
+ */
+static dc_status_t create_replay_parser(device_data_t *devdata, dc_parser_t **parser)
+{
+	dc_context_t *context = devdata->context;
+	unsigned int model = devinfo_model;
+	dc_family_t family = dc_descriptor_get_type(devdata->descriptor);
+
+	switch (family) {
+	case DC_FAMILY_SUUNTO_SOLUTION:
+		return suunto_solution_parser_create(parser, context);
+	case DC_FAMILY_SUUNTO_EON:
+		return suunto_eon_parser_create(parser, context, 0);
+	case DC_FAMILY_SUUNTO_VYPER:
+		if (model == 0x01)
+			return suunto_eon_parser_create(parser, context, 1);
+		return suunto_vyper_parser_create(parser, context);
+	case DC_FAMILY_SUUNTO_VYPER2:
+	case DC_FAMILY_SUUNTO_D9:
+		return suunto_d9_parser_create(parser, context, model);
+	case DC_FAMILY_UWATEC_ALADIN:
+	case DC_FAMILY_UWATEC_MEMOMOUSE:
+		return uwatec_memomouse_parser_create(parser, context, clock_devtime, clock_systime);
+	case DC_FAMILY_UWATEC_SMART:
+		return uwatec_smart_parser_create(parser, context, model, clock_devtime, clock_systime);
+	case DC_FAMILY_REEFNET_SENSUS:
+		return reefnet_sensus_parser_create(parser, context, clock_devtime, clock_systime);
+	case DC_FAMILY_REEFNET_SENSUSPRO:
+		return reefnet_sensuspro_parser_create(parser, context, clock_devtime, clock_systime);
+	case DC_FAMILY_REEFNET_SENSUSULTRA:
+		return reefnet_sensusultra_parser_create(parser, context, clock_devtime, clock_systime);
+	case DC_FAMILY_OCEANIC_VTPRO:
+		return oceanic_vtpro_parser_create(parser, context);
+	case DC_FAMILY_OCEANIC_VEO250:
+		return oceanic_veo250_parser_create(parser, context, model);
+	case DC_FAMILY_OCEANIC_ATOM2:
+		return oceanic_atom2_parser_create(parser, context, model);
+	case DC_FAMILY_MARES_NEMO:
+	case DC_FAMILY_MARES_PUCK:
+		return mares_nemo_parser_create(parser, context, model);
+	case DC_FAMILY_MARES_DARWIN:
+		return mares_darwin_parser_create(parser, context, model);
+	case DC_FAMILY_MARES_ICONHD:
+		return mares_iconhd_parser_create(parser, context, model);
+	case DC_FAMILY_HW_OSTC:
+		return hw_ostc_parser_create(parser, context NOT_FROG);
+#ifdef LIBDIVECOMPUTER_SUPPORTS_FROG
+	case DC_FAMILY_HW_FROG:
+		return hw_ostc_parser_create(parser, context, 1);
+#endif
+	case DC_FAMILY_CRESSI_EDY:
+	case DC_FAMILY_ZEAGLE_N2ITION3:
+		return cressi_edy_parser_create(parser, context, model);
+	case DC_FAMILY_ATOMICS_COBALT:
+		return atomics_cobalt_parser_create(parser, context);
+	case DC_FAMILY_SHEARWATER_PREDATOR:
+		return shearwater_predator_parser_create(parser, context);
+	default:
+		return DC_STATUS_UNSUPPORTED;
+	}
+}
+
 static dc_status_t create_parser(device_data_t *devdata, dc_parser_t **parser)
 {
+	if (!devdata->device)
+		return create_replay_parser(devdata, parser);
 	return dc_parser_new(parser, devdata->device);
 }
 
@@ -291,7 +378,7 @@ static int might_be_same_dc(struct divecomputer *a, struct divecomputer *b)
 {
 	if (!a->model || !b->model)
 		return 1;
-	if (strcasecmp(a->model, b->model))
+	if (a->model != b->model && strcasecmp(a->model, b->model))
 		return 0;
 	if (!a->deviceid || !b->deviceid)
 		return 1;
@@ -384,13 +471,19 @@ static uint32_t calculate_diveid(const unsigned char *fingerprint, unsigned int
 	return csum[0];
 }
 
-static int dive_cb(const unsigned char *data, unsigned int size,
-	const unsigned char *fingerprint, unsigned int fsize,
-	void *userdata)
+/*
+ * The fingerprint of the first dive the device gives us - they
+ * come newest first - to remember for the next download.
+ */
+static unsigned char newest_fingerprint[64];
+static unsigned int newest_fsize;
+static int downloaded_dives;
+
+static int parse_dive(device_data_t *devdata, const unsigned char *data, unsigned int size,
+	const unsigned char *fingerprint, unsigned int fsize)
 {
 	int rc;
 	dc_parser_t *parser = NULL;
-	device_data_t *devdata = userdata;
 	dc_datetime_t dt = {0};
 	struct tm tm;
 	struct dive *dive;
@@ -418,9 +511,10 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS && rc != DC_STATUS_UNSUPPORTED) {
 		dev_info(devdata, _("Error parsing the datetime"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
-	dive->dc.model = strdup(devdata->model);
+	dive->dc.model = intern_string(devdata->model);
 	dive->dc.deviceid = devdata->deviceid;
 	dive->dc.diveid = calculate_diveid(fingerprint, fsize);
 
@@ -440,6 +534,7 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS && rc != DC_STATUS_UNSUPPORTED) {
 		dev_info(devdata, _("Error parsing the divetime"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
 	dive->dc.duration.seconds = divetime;
@@ -450,6 +545,7 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS && rc != DC_STATUS_UNSUPPORTED) {
 		dev_info(devdata, _("Error parsing the maxdepth"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
 	dive->dc.maxdepth.mm = maxdepth * 1000 + 0.5;
@@ -460,6 +556,7 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS && rc != DC_STATUS_UNSUPPORTED) {
 		dev_info(devdata, _("Error parsing the gas mix count"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
 
@@ -470,6 +567,7 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS && rc != DC_STATUS_UNSUPPORTED) {
 		dev_info(devdata, _("Error obtaining water salinity"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
 	dive->salinity = salinity * 10000.0 + 0.5;
@@ -479,6 +577,7 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS) {
 		dev_info(devdata, _("Error parsing the gas mix"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
 
@@ -487,14 +586,17 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 	if (rc != DC_STATUS_SUCCESS) {
 		dev_info(devdata, _("Error parsing the samples"));
 		dc_parser_destroy(parser);
+		free_dive(dive);
 		return rc;
 	}
 
 	dc_parser_destroy(parser);
 
 	/* If we already saw this dive, abort. */
-	if (!devdata->force_download && find_dive(&dive->dc))
+	if (!devdata->force_download && find_dive(&dive->dc)) {
+		free_dive(dive);
 		return 0;
+	}
 
 	/* Various libdivecomputer interface fixups */
 	if (first_temp_is_air && dive->dc.samples) {
@@ -509,9 +611,231 @@ static int dive_cb(const unsigned char *data, unsigned int size,
 }
 
 
+/*
+ * The download and the parsing of the dives run in parallel: the
+ * libdivecomputer callback only copies each raw dive into this queue,
+ * and the parser thread turns them into dives in the same order.
+ * There is a single parser, as the sample callbacks keep their state
+ * in globals and the dives have to be recorded in order anyway.
+ *
+ * When the parser finds a dive we already have, it tells the download
+ * to stop - the dives come newest first, so the rest is old, too.
+ */
+#define RAW_DIVE_QUEUE 16
+
+struct raw_dive {
+	unsigned char *data, *fingerprint;
+	unsigned int size, fsize;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct raw_dive dive[RAW_DIVE_QUEUE];
+	int first, nr;
+	gboolean done, stop;
+} queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static unsigned char *copy_blob(const unsigned char *data, unsigned int size)
+{
+	unsigned char *copy = malloc(size ? size : 1);
+
+	if (copy)
+		memcpy(copy, data, size);
+	return copy;
+}
+
+/* returns 0 once the parser wants the download to stop */
+static int queue_raw_dive(const unsigned char *data, unsigned int size,
+	const unsigned char *fingerprint, unsigned int fsize)
+{
+	struct raw_dive raw = { copy_blob(data, size), copy_blob(fingerprint, fsize), size, fsize };
+	int more;
+
+	if (!raw.data || !raw.fingerprint) {
+		free(raw.data);
+		free(raw.fingerprint);
+		return 1;
+	}
+	pthread_mutex_lock(&queue.lock);
+	while (queue.nr == RAW_DIVE_QUEUE && !queue.stop)
+		pthread_cond_wait(&queue.cond, &queue.lock);
+	more = !queue.stop;
+	if (more) {
+		queue.dive[(queue.first + queue.nr++) % RAW_DIVE_QUEUE] = raw;
+		pthread_cond_broadcast(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	if (!more) {
+		free(raw.data);
+		free(raw.fingerprint);
+	}
+	return more;
+}
+
+static gboolean next_raw_dive(struct raw_dive *raw)
+{
+	gboolean found;
+
+	pthread_mutex_lock(&queue.lock);
+	while (!queue.nr && !queue.done)
+		pthread_cond_wait(&queue.cond, &queue.lock);
+	found = queue.nr > 0;
+	if (found) {
+		*raw = queue.dive[queue.first];
+		queue.first = (queue.first + 1) % RAW_DIVE_QUEUE;
+		queue.nr--;
+		pthread_cond_broadcast(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return found;
+}
+
+static void stop_raw_dives(void)
+{
+	pthread_mutex_lock(&queue.lock);
+	queue.stop = TRUE;
+	pthread_cond_broadcast(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static void *parser_thread(void *_devdata)
+{
+	device_data_t *devdata = _devdata;
+	struct raw_dive raw;
+	gboolean stopped = FALSE;
+
+	/* the dives we make belong to the download */
+	join_import();
+	while (next_raw_dive(&raw)) {
+		/* after a dive we already had, the rest just gets dropped */
+		if (!stopped && !parse_dive(devdata, raw.data, raw.size, raw.fingerprint, raw.fsize)) {
+			stop_raw_dives();
+			stopped = TRUE;
+		}
+		free(raw.data);
+		free(raw.fingerprint);
+	}
+	leave_import();
+	return NULL;
+}
+
+static int dive_cb(const unsigned char *data, unsigned int size,
+	const unsigned char *fingerprint, unsigned int fsize,
+	void *userdata)
+{
+	device_data_t *devdata = userdata;
+
+	replay_write("fingerprint", fingerprint, fsize);
+	replay_write("dive", data, size);
+	if (!downloaded_dives++ && fsize <= sizeof(newest_fingerprint)) {
+		memcpy(newest_fingerprint, fingerprint, fsize);
+		newest_fsize = fsize;
+	}
+	if (!devdata->pipelined)
+		return parse_dive(devdata, data, size, fingerprint, fsize);
+	return queue_raw_dive(data, size, fingerprint, fsize);
+}
+
+static void event_cb(dc_device_t *device, dc_event_type_t event, const void *data, void *userdata);
+static int import_thread_done = 0, import_thread_cancelled;
+
+/*
+ * dc_device_foreach() for a replay: the device information, the clock
+ * and the dives come out of the replay file, in the order they came
+ * from the device. Like libdivecomputer, this stops at the dive we
+ * got last time.
+ */
+static dc_status_t replay_foreach(device_data_t *devdata, dc_dive_callback_t callback)
+{
+	unsigned char stop[sizeof(newest_fingerprint)], *fingerprint = NULL, *data;
+	unsigned int stopsize = 0, fsize = 0;
+	dc_status_t rc = DC_STATUS_SUCCESS;
+	char *tag;
+	int size;
+
+	while ((size = replay_next(&tag, &data)) >= 0) {
+		if (import_thread_cancelled) {
+			rc = DC_STATUS_CANCELLED;
+		} else if (!strcmp(tag, "device")) {
+			/* a replay of some other dive computer */
+			if (strcmp((char *)data, devdata->model))
+				rc = DC_STATUS_INVALIDARGS;
+		} else if (!strcmp(tag, "family")) {
+			unsigned int family, model;
+			dc_parser_t *parser;
+
+			/* recorded with another descriptor, or we can't parse it */
+			if (sscanf((char *)data, "%u %u", &family, &model) != 2)
+				rc = DC_STATUS_DATAFORMAT;
+			else if (family != dc_descriptor_get_type(devdata->descriptor) ||
+				 model != dc_descriptor_get_model(devdata->descriptor))
+				rc = DC_STATUS_INVALIDARGS;
+			else if ((rc = create_replay_parser(devdata, &parser)) == DC_STATUS_SUCCESS)
+				dc_parser_destroy(parser);
+		} else if (!strcmp(tag, "devinfo")) {
+			dc_event_devinfo_t devinfo;
+
+			if (sscanf((char *)data, "%u %u %u", &devinfo.model, &devinfo.firmware, &devinfo.serial) != 3) {
+				rc = DC_STATUS_DATAFORMAT;
+			} else {
+				event_cb(NULL, DC_EVENT_DEVINFO, &devinfo, devdata);
+				if (!devdata->force_download)
+					stopsize = get_device_fingerprint(get_device_info(devdata->model, devdata->deviceid),
+									  stop, sizeof(stop));
+			}
+		} else if (!strcmp(tag, "clock")) {
+			dc_event_clock_t clock;
+			unsigned long long systime;
+
+			if (sscanf((char *)data, "%u %llu", &clock.devtime, &systime) != 2) {
+				rc = DC_STATUS_DATAFORMAT;
+			} else {
+				clock.systime = systime;
+				event_cb(NULL, DC_EVENT_CLOCK, &clock, devdata);
+			}
+		} else if (!strcmp(tag, "fingerprint")) {
+			free(fingerprint);
+			fingerprint = data;
+			fsize = size;
+			continue;
+		} else if (!strcmp(tag, "dive")) {
+			if (stopsize && fsize == stopsize && !memcmp(fingerprint, stop, fsize))
+				size = -1;
+			else if (!callback(data, size, fingerprint, fsize, devdata))
+				size = -1;
+		}
+		free(data);
+		if (rc != DC_STATUS_SUCCESS || size < 0)
+			break;
+	}
+	free(fingerprint);
+	return rc;
+}
+
 static dc_status_t import_device_data(dc_device_t *device, device_data_t *devicedata)
 {
-	return dc_device_foreach(device, dive_cb, devicedata);
+	pthread_t parser;
+	dc_status_t rc;
+
+	queue.first = queue.nr = 0;
+	queue.done = queue.stop = FALSE;
+	/* without a parser thread we just parse inside the callback */
+	devicedata->pipelined = !pthread_create(&parser, NULL, parser_thread, devicedata);
+
+	if (device)
+		rc = dc_device_foreach(device, dive_cb, devicedata);
+	else
+		rc = replay_foreach(devicedata, dive_cb);
+
+	if (devicedata->pipelined) {
+		pthread_mutex_lock(&queue.lock);
+		queue.done = TRUE;
+		pthread_cond_broadcast(&queue.cond);
+		pthread_mutex_unlock(&queue.lock);
+		pthread_join(parser, NULL);
+	}
+	return rc;
 }
 
 /*
@@ -627,6 +951,8 @@ static void event_cb(dc_device_t *device, dc_event_type_t event, const void *dat
 		progress_bar_fraction = (double) progress->current / (double) progress->maximum;
 		break;
 	case DC_EVENT_DEVINFO:
+		replay_printf("devinfo", "%u %u %u", devinfo->model, devinfo->firmware, devinfo->serial);
+		devinfo_model = devinfo->model;
 		dev_info(devdata, _("model=%u (0x%08x), firmware=%u (0x%08x), serial=%u (0x%08x)"),
 			devinfo->model, devinfo->model,
 			devinfo->firmware, devinfo->firmware,
@@ -640,8 +966,21 @@ static void event_cb(dc_device_t *device, dc_event_type_t event, const void *dat
 			serial = fixup_suunto_versions(devdata, devinfo);
 		devdata->deviceid = calculate_sha1(devinfo->model, devinfo->firmware, serial);
 
+		/* only download the dives that are newer than the ones we got last time */
+		if (!devdata->force_download) {
+			unsigned char fingerprint[sizeof(newest_fingerprint)];
+			unsigned int fsize;
+
+			fsize = get_device_fingerprint(get_device_info(devdata->model, devdata->deviceid),
+						       fingerprint, sizeof(fingerprint));
+			if (fsize && device)
+				dc_device_set_fingerprint(device, fingerprint, fsize);
+		}
 		break;
 	case DC_EVENT_CLOCK:
+		replay_printf("clock", "%u %llu", clock->devtime, (unsigned long long)clock->systime);
+		clock_devtime = clock->devtime;
+		clock_systime = clock->systime;
 			dev_info(devdata, _("Event: systime=%"PRId64", devtime=%u\n"),
 			(uint64_t)clock->systime, clock->devtime);
 		break;
@@ -650,8 +989,6 @@ static void event_cb(dc_device_t *device, dc_event_type_t event, const void *dat
 	}
 }
 
-static int import_thread_done = 0, import_thread_cancelled;
-
 static int
 cancel_cb(void *userdata)
 {
@@ -664,6 +1001,11 @@ static const char *do_device_import(device_data_t *data)
 	dc_device_t *device = data->device;
 
 	data->model = str_printf("%s %s", data->vendor, data->product);
+	replay_printf("device", "%s", data->model);
+	replay_printf("family", "%u %u", dc_descriptor_get_type(data->descriptor),
+		      dc_descriptor_get_model(data->descriptor));
+	if (!device)
+		goto import;
 
 	// Register the event handler.
 	int events = DC_EVENT_WAITING | DC_EVENT_PROGRESS | DC_EVENT_DEVINFO | DC_EVENT_CLOCK;
@@ -676,10 +1018,17 @@ static const char *do_device_import(device_data_t *data)
 	if (rc != DC_STATUS_SUCCESS)
 		return _("Error registering the cancellation handler.");
 
+import:
 	rc = import_device_data(device, data);
+	if (rc == DC_STATUS_UNSUPPORTED && !device)
+		return _("Replaying downloads from this dive computer is not supported");
 	if (rc != DC_STATUS_SUCCESS)
 		return _("Dive data import error");
 
+	if (newest_fsize)
+		set_device_fingerprint(create_device_info(data->model, data->deviceid),
+				       newest_fingerprint, newest_fsize);
+
 	/* All good */
 	return NULL;
 }
@@ -690,6 +1039,8 @@ static const char *do_libdivecomputer_import(device_data_t *data)
 	const char *err;
 
 	import_dive_number = 0;
+	newest_fsize = 0;
+	downloaded_dives = 0;
 	first_temp_is_air = 0;
 	data->device = NULL;
 	data->context = NULL;
@@ -698,12 +1049,24 @@ static const char *do_libdivecomputer_import(device_data_t *data)
 	if (rc != DC_STATUS_SUCCESS)
 		return _("Unable to create libdivecomputer context");
 
-	err = _("Unable to open %s %s (%s)");
-	rc = dc_device_open(&data->device, data->context, data->descriptor, data->devname);
-	if (rc == DC_STATUS_SUCCESS) {
+	switch (replay_begin()) {
+	case REPLAY_ERROR:
+		err = _("Unable to open the replay file for %s %s");
+		break;
+	case REPLAY_PLAYBACK:
+		/* no device, the dives come from the replay file */
 		err = do_device_import(data);
-		dc_device_close(data->device);
+		break;
+	default:
+		err = _("Unable to open %s %s (%s)");
+		rc = dc_device_open(&data->device, data->context, data->descriptor, data->devname);
+		if (rc == DC_STATUS_SUCCESS) {
+			err = do_device_import(data);
+			dc_device_close(data->device);
+		}
+		break;
 	}
+	replay_end();
 	dc_context_free(data->context);
 	return err;
 }
@@ -711,7 +1074,11 @@ static const char *do_libdivecomputer_import(device_data_t *data)
 static void *pthread_wrapper(void *_data)
 {
 	device_data_t *data = _data;
-	const char *err_string = do_libdivecomputer_import(data);
+	const char *err_string;
+
+	begin_import();
+	err_string = do_libdivecomputer_import(data);
+	end_import();
 	import_thread_done = 1;
 	return (void *)err_string;
 }
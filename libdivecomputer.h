@@ -20,6 +20,7 @@ typedef struct device_data_t {
 	progressbar_t progress;
 	int preexisting;
 	gboolean force_download;
+	gboolean pipelined;	/* the dives are parsed in a thread of their own */
 	GtkDialog *dialog;
 } device_data_t;
 
@@ -9,6 +9,8 @@
 
 #include "dive.h"
 #include "divelist.h"
+#include "trace.h"
+#include "replay.h"
 
 #if HAVE_OSM_GPS_MAP
 #include <osm-gps-map.h>
@@ -43,175 +45,11 @@ struct preferences default_prefs = {
 #endif
 };
 
-/* random helper functions, used here or elsewhere */
-static int sortfn(const void *_a, const void *_b)
-{
-	const struct dive *a = *(void **)_a;
-	const struct dive *b = *(void **)_b;
-
-	if (a->when < b->when)
-		return -1;
-	if (a->when > b->when)
-		return 1;
-	return 0;
-}
-
-void sort_table(struct dive_table *table)
-{
-	qsort(table->dives, table->nr, sizeof(struct dive *), sortfn);
-}
-
-const char *weekday(int wday)
-{
-	static const char wday_array[7][7] = {
-		/*++GETTEXT: these are three letter days - we allow up to six code bytes */
-		N_("Sun"), N_("Mon"), N_("Tue"), N_("Wed"), N_("Thu"), N_("Fri"), N_("Sat")
-	};
-	return _(wday_array[wday]);
-}
-
-const char *monthname(int mon)
-{
-	static const char month_array[12][7] = {
-		/*++GETTEXT: these are three letter months - we allow up to six code bytes*/
-		N_("Jan"), N_("Feb"), N_("Mar"), N_("Apr"), N_("May"), N_("Jun"),
-		N_("Jul"), N_("Aug"), N_("Sep"), N_("Oct"), N_("Nov"), N_("Dec"),
-	};
-	return _(month_array[mon]);
-}
-
-/*
- * When adding dives to the dive table, we try to renumber
- * the new dives based on any old dives in the dive table.
- *
- * But we only do it if:
- *
- *  - there are no dives in the dive table
- *
- *  OR
- *
- *  - the last dive in the old dive table was numbered
- *
- *  - all the new dives are strictly at the end (so the
- *    "last dive" is at the same location in the dive table
- *    after re-sorting the dives.
- *
- *  - none of the new dives have any numbers
- *
- * This catches the common case of importing new dives from
- * a dive computer, and gives them proper numbers based on
- * your old dive list. But it tries to be very conservative
- * and not give numbers if there is *any* question about
- * what the numbers should be - in which case you need to do
- * a manual re-numbering.
- */
-static void try_to_renumber(struct dive *last, int preexisting)
-{
-	int i, nr;
-
-	/*
-	 * If the new dives aren't all strictly at the end,
-	 * we're going to expect the user to do a manual
-	 * renumbering.
-	 */
-	if (preexisting && get_dive(preexisting-1) != last)
-		return;
-
-	/*
-	 * If any of the new dives already had a number,
-	 * we'll have to do a manual renumbering.
-	 */
-	for (i = preexisting; i < dive_table.nr; i++) {
-		struct dive *dive = get_dive(i);
-		if (dive->number)
-			return;
-	}
-
-	/*
-	 * Ok, renumber..
-	 */
-	if (last)
-		nr = last->number;
-	else
-		nr = 0;
-	for (i = preexisting; i < dive_table.nr; i++) {
-		struct dive *dive = get_dive(i);
-		dive->number = ++nr;
-	}
-}
-
 /*
  * track whether we switched to importing dives
  */
 static gboolean imported = FALSE;
 
-/*
- * This doesn't really report anything at all. We just sort the
- * dives, the GUI does the reporting
- */
-void report_dives(gboolean is_imported, gboolean prefer_imported)
-{
-	int i;
-	int preexisting = dive_table.preexisting;
-	struct dive *last;
-
-	/* check if we need a nickname for the divecomputer for newly downloaded dives;
-	 * since we know they all came from the same divecomputer we just check for the
-	 * first one */
-	if (preexisting < dive_table.nr && dive_table.dives[preexisting]->downloaded)
-		set_dc_nickname(dive_table.dives[preexisting]);
-	else
-		/* they aren't downloaded, so record / check all new ones */
-		for (i = preexisting; i < dive_table.nr; i++)
-			set_dc_nickname(dive_table.dives[i]);
-
-	/* This does the right thing for -1: NULL */
-	last = get_dive(preexisting-1);
-
-	sort_table(&dive_table);
-
-	for (i = 1; i < dive_table.nr; i++) {
-		struct dive **pp = &dive_table.dives[i-1];
-		struct dive *prev = pp[0];
-		struct dive *dive = pp[1];
-		struct dive *merged;
-
-		/* only try to merge overlapping dives - or if one of the dives has
-		 * zero duration (that might be a gps marker from the webservice) */
-		if (prev->duration.seconds && dive->duration.seconds &&
-		    prev->when + prev->duration.seconds < dive->when)
-			continue;
-
-		merged = try_to_merge(prev, dive, prefer_imported);
-		if (!merged)
-			continue;
-
-		/* careful - we might free the dive that last points to. Oops... */
-		if (last == prev || last == dive)
-			last = merged;
-
-		/* Redo the new 'i'th dive */
-		i--;
-		add_single_dive(i, merged);
-		delete_single_dive(i+1);
-		delete_single_dive(i+1);
-	}
-	/* make sure no dives are still marked as downloaded */
-	for (i = 1; i < dive_table.nr; i++)
-		dive_table.dives[i]->downloaded = FALSE;
-
-	if (is_imported) {
-		/* If there are dives in the table, are they numbered */
-		if (!last || last->number)
-			try_to_renumber(last, preexisting);
-
-		/* did we add dives to the dive table? */
-		if (preexisting != dive_table.nr)
-			mark_divelist_changed(TRUE);
-	}
-	dive_list_update_dives();
-}
-
 static void parse_argument(const char *arg)
 {
 	const char *p = arg+1;
@@ -230,6 +68,38 @@ static void parse_argument(const char *arg)
 				imported = TRUE;
 				return;
 			}
+			/* timing summary and trace of the TRACE=1 spans */
+			if (strcmp(arg, "--profile") == 0) {
+				trace_set_summary();
+				return;
+			}
+			if (strncmp(arg, "--trace=", 8) == 0) {
+				trace_set_output(arg + 8);
+				return;
+			}
+			/* downloads to and from a file instead of the dive computer */
+			if (strncmp(arg, "--record=", 9) == 0) {
+				set_replay_record(arg + 9);
+				return;
+			}
+			if (strncmp(arg, "--replay=", 9) == 0) {
+				set_replay_playback(arg + 9);
+				return;
+			}
+			if (strncmp(arg, "--replay-latency=", 17) == 0) {
+				set_replay_latency(atoi(arg + 17));
+				return;
+			}
+			/* simplify the depth profiles of the dives read after this, in mm */
+			if (strncmp(arg, "--decimate=", 11) == 0) {
+				sample_tolerance = atoi(arg + 11);
+				return;
+			}
+			/* keep the samples of the dives that aren't displayed packed */
+			if (strcmp(arg, "--pack-samples") == 0) {
+				compress_samples = 1;
+				return;
+			}
 			/* fallthrough */
 		case 'p':
 			/* ignore process serial number argument when run as native macosx app */
@@ -377,6 +247,7 @@ int main(int argc, char **argv)
 
 	parse_xml_exit();
 	subsurface_command_line_exit(&argc, &argv);
+	trace_exit();
 
 #ifdef DEBUGFILE
 	if (debugfile)
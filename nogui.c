@@ -0,0 +1,31 @@
+/* nogui.c */
+/* the settings and the UI hooks of the core code for the
+ * command line tools that are built without any UI
+ * (the benchmarks and the logbook generator)
+ */
+#include "dive.h"
+#include "divelist.h"
+
+struct preferences prefs, default_prefs = {
+	.units = SI_UNITS,
+	.pp_graphs = {
+		.po2_threshold =  1.6,
+		.pn2_threshold =  4.0,
+		.phe_threshold = 13.0,
+	},
+	.mod_ppO2  = 1.6,
+	.gflow = 0.30,
+	.gfhigh = 0.75,
+};
+
+void add_cylinder_description(cylinder_type_t *type) {}
+void add_weightsystem_description(weightsystem_t *weightsystem) {}
+void add_people(const char *string) {}
+void add_location(const char *string) {}
+void add_suit(const char *string) {}
+void remember_event(const char *eventname) {}
+void dive_list_update_dives(void) {}
+void show_and_select_dive(struct dive *dive) {}
+void set_dc_nickname(struct dive *dive) {}
+void set_autogroup(gboolean value) {}
+void update_dive(struct dive *new_dive) {}
@@ -5,11 +5,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 #define __USE_XOPEN
 #include <time.h>
 #include <libxml/parser.h>
 #include <libxml/parserInternals.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #ifdef XSLT
 #include <libxslt/transform.h>
 #endif
@@ -20,11 +22,15 @@
 #endif
 
 #include "dive.h"
+#include "divelist.h"
 #include "device.h"
+#include "intern.h"
+#include "trace.h"
 
 int verbose;
 
 static xmlDoc *test_xslt_transforms(xmlDoc *doc, GError **error);
+static void free_stylesheets(void);
 
 /* the dive table holds the overall dive list; target table points at
  * the table we are currently filling */
@@ -118,7 +124,7 @@ static struct {
 struct {
 	const char *model;
 	uint32_t deviceid;
-	const char *nickname, *serial_nr, *firmware;
+	const char *nickname, *serial_nr, *firmware, *fingerprint;
 } dc;
 } cur_settings;
 static gboolean in_settings = FALSE;
@@ -126,6 +132,7 @@ static struct tm cur_tm;
 static int cur_cylinder_index, cur_ws_index;
 static int lastndl, laststoptime, laststopdepth, lastcns, lastpo2, lastindeco;
 static int lastcylinderindex, lastsensor;
+static struct event *lastevent;
 
 /*
  * If we don't have an explicit dive computer,
@@ -492,6 +499,33 @@ static void utf8_string(char *buffer, void *_res)
 	*(char **)_res = res;
 }
 
+/* for the metadata that repeats from dive to dive, see intern.h */
+static void utf8_intern(char *buffer, void *_res)
+{
+	char copy[256];
+	int size;
+
+	while (g_ascii_isspace(*buffer))
+		buffer++;
+	size = strlen(buffer);
+	while (size && g_ascii_isspace(buffer[size-1]))
+		size--;
+	if (!size)
+		return;
+	/* these are short, so usually there's no need to allocate a copy */
+	if (size < sizeof(copy)) {
+		memcpy(copy, buffer, size);
+		copy[size] = 0;
+		*(const char **)_res = intern_string(copy);
+	} else {
+		char *res = NULL;
+
+		utf8_string(buffer, &res);
+		*(const char **)_res = intern_string(res);
+		free(res);
+	}
+}
+
 #define MATCH(pattern, fn, dest) \
 	match(pattern, strlen(pattern), name, len, fn, buf, dest)
 
@@ -510,12 +544,19 @@ static void get_rating(char *buffer, void *_i)
 	}
 }
 
+/* sample po2 in bar */
 static void double_to_permil(char *buffer, void *_i)
 {
-	int *i = _i;
+	uint16_t *i = _i;
 	*i = g_ascii_strtod(buffer, NULL) * 1000.0 + 0.5;
 }
 
+static void get_cns(char *buffer, void *_cns)
+{
+	uint16_t *cns = _cns;
+	*cns = atoi(buffer);
+}
+
 static void hex_value(char *buffer, void *_i)
 {
 	uint32_t *i = _i;
@@ -617,24 +658,171 @@ static int divinglog_fill_sample(struct sample *sample, const char *name, int le
 		0;
 }
 
+/*
+ * UDDF has the gas mixes and the dive computer once per file, before
+ * the dives, and the dives refer to the mixes by their id. Every dive
+ * gets all the mixes as its cylinders, in the same order.
+ */
+static struct {
+	char *id;
+	const char *name;
+	struct gasmix gasmix;
+} uddf_mix[MAX_CYLINDERS];
+static int uddf_mixes;
+static gboolean uddf_mix_ignored;	/* the one being read didn't fit */
+static char *uddf_model, *uddf_serial, *uddf_firmware;
+
+/*
+ * Some programs write 273.15 (0C) for temperatures they don't have.
+ * Unless a dive has at least one other sample temperature, its sample
+ * temperatures and a 273.15 lowest temperature are thrown away.
+ */
+static int uddf_real_temps;
+static gboolean uddf_lowest_placeholder;
+
+static void uddf_reset(void)
+{
+	int i;
+
+	for (i = 0; i < uddf_mixes; i++)
+		free(uddf_mix[i].id);
+	memset(uddf_mix, 0, sizeof(uddf_mix));
+	uddf_mixes = 0;
+	uddf_mix_ignored = FALSE;
+	uddf_real_temps = 0;
+	uddf_lowest_placeholder = FALSE;
+	free(uddf_model);
+	free(uddf_serial);
+	free(uddf_firmware);
+	uddf_model = uddf_serial = uddf_firmware = NULL;
+}
+
+/* the id comes first, it's an attribute */
+static void uddf_mix_id(char *buffer, void *_unused)
+{
+	uddf_mix_ignored = uddf_mixes >= MAX_CYLINDERS;
+	if (!uddf_mix_ignored)
+		uddf_mix[uddf_mixes++].id = strdup(buffer);
+}
+
+static void uddf_mix_name(char *buffer, void *_unused)
+{
+	if (uddf_mixes && !uddf_mix_ignored)
+		utf8_intern(buffer, &uddf_mix[uddf_mixes - 1].name);
+}
+
+static void uddf_mix_fraction(char *buffer, void *_fraction)
+{
+	if (uddf_mixes && !uddf_mix_ignored)
+		percent(buffer, _fraction);
+}
+
+static int try_to_fill_uddf(const char *name, char *buf)
+{
+	int len = strlen(name);
+	struct gasmix *mix = &uddf_mix[MAX(uddf_mixes - 1, 0)].gasmix;
+
+	return	MATCH(".generator.name", utf8_string, &uddf_model) ||
+		MATCH(".generator.version", utf8_string, &uddf_serial) ||
+		MATCH(".generator.manufacturer.name", utf8_string, &uddf_firmware) ||
+		MATCH(".gasdefinitions.mix.id", uddf_mix_id, NULL) ||
+		MATCH(".gasdefinitions.mix.name", uddf_mix_name, NULL) ||
+		MATCH(".gasdefinitions.mix.o2", uddf_mix_fraction, &mix->o2) ||
+		MATCH(".gasdefinitions.mix.he", uddf_mix_fraction, &mix->he) ||
+		0;
+}
+
+static void uddf_fill_cylinders(struct dive *dive)
+{
+	int i;
+
+	for (i = 0; i < uddf_mixes; i++) {
+		cylinder_t *cyl = dive->cylinder + i;
+
+		if (!cyl->type.description)
+			cyl->type.description = uddf_mix[i].name;
+		cyl->gasmix = uddf_mix[i].gasmix;
+	}
+}
+
+static void uddf_sample_temperature(char *buffer, void *_temperature)
+{
+	if (g_ascii_strtod(buffer, NULL) != 273.15)
+		uddf_real_temps++;
+	temperature(buffer, _temperature);
+}
+
+static void uddf_lowest_temperature(char *buffer, void *_temperature)
+{
+	uddf_lowest_placeholder = g_ascii_strtod(buffer, NULL) == 273.15;
+	temperature(buffer, _temperature);
+}
+
+static void uddf_dive_end(struct dive *dive)
+{
+	struct device_info *info;
+	int i;
+
+	if (!uddf_real_temps) {
+		for (i = 0; i < dive->dc.samples; i++)
+			dive->dc.sample[i].temperature.mkelvin = 0;
+		if (uddf_lowest_placeholder)
+			dive->dc.watertemp.mkelvin = 0;
+	}
+	uddf_real_temps = 0;
+	uddf_lowest_placeholder = FALSE;
+
+	uddf_fill_cylinders(dive);
+	if (!dive->dc.model && uddf_model)
+		dive->dc.model = intern_string(uddf_model);
+	if (!dive->dc.deviceid)
+		dive->dc.deviceid = 0xffffffff;
+	if (!dive->dc.when)
+		dive->dc.when = dive->when;
+
+	/* the generator is the dive computer, with the version as its serial */
+	info = create_device_info(dive->dc.model, dive->dc.deviceid);
+	if (info) {
+		if (!info->serial_nr && uddf_serial)
+			info->serial_nr = strdup(uddf_serial);
+		if (!info->firmware && uddf_firmware)
+			info->firmware = strdup(uddf_firmware);
+	}
+}
+
 static void uddf_gasswitch(char *buffer, void *_sample)
 {
 	struct sample *sample = _sample;
-	int idx = atoi(buffer);
+	int idx;
 	int seconds = sample->time.seconds;
 	struct dive *dive = cur_dive;
 	struct divecomputer *dc = get_dc();
 
+	for (idx = 0; idx < uddf_mixes; idx++)
+		if (!strcmp(uddf_mix[idx].id, buffer))
+			break;
+	if (idx == uddf_mixes)
+		return;
+	uddf_fill_cylinders(dive);
 	add_gas_switch_event(dive, dc, seconds, idx);
 }
 
+/* the setpoint is in Pascal */
+static void uddf_po2(char *buffer, void *_po2)
+{
+	uint16_t *po2 = _po2;
+	*po2 = g_ascii_strtod(buffer, NULL) / 100 + 0.5;
+}
+
 static int uddf_fill_sample(struct sample *sample, const char *name, int len, char *buf)
 {
 	return	MATCH(".divetime", sampletime, &sample->time) ||
 		MATCH(".depth", depth, &sample->depth) ||
-		MATCH(".temperature", temperature, &sample->temperature) ||
+		MATCH(".temperature", uddf_sample_temperature, &sample->temperature) ||
 		MATCH(".tankpressure", pressure, &sample->cylinderpressure) ||
 		MATCH(".switchmix.ref", uddf_gasswitch, sample) ||
+		MATCH(".setpo2", uddf_po2, &sample->po2) ||
+		MATCH(".cns", get_cns, &sample->cns) ||
 		0;
 }
 
@@ -674,6 +862,8 @@ static void try_to_fill_dc_settings(const char *name, char *buf)
 		return;
 	if (MATCH("divecomputerid.firmware", utf8_string, &cur_settings.dc.firmware))
 		return;
+	if (MATCH("divecomputerid.fingerprint", utf8_string, &cur_settings.dc.fingerprint))
+		return;
 
 	nonmatch("divecomputerid", name, buf);
 }
@@ -743,7 +933,7 @@ static void try_to_fill_dc(struct divecomputer *dc, const char *name, char *buf)
 		return;
 	if (MATCH(".time", divetime, &dc->when))
 		return;
-	if (MATCH(".model", utf8_string, &dc->model))
+	if (MATCH(".model", utf8_intern, &dc->model))
 		return;
 	if (MATCH(".deviceid", hex_value, &dc->deviceid))
 		return;
@@ -774,7 +964,7 @@ void add_gas_switch_event(struct dive *dive, struct divecomputer *dc, int second
 
 static void get_cylinderindex(char *buffer, void *_i)
 {
-	int *i = _i;
+	uint8_t *i = _i;
 	*i = atoi(buffer);
 	if (lastcylinderindex != *i) {
 		add_gas_switch_event(cur_dive, get_dc(), cur_sample->time.seconds, *i);
@@ -784,7 +974,7 @@ static void get_cylinderindex(char *buffer, void *_i)
 
 static void get_sensor(char *buffer, void *_i)
 {
-	int *i = _i;
+	uint8_t *i = _i;
 	*i = atoi(buffer);
 	lastsensor = *i;
 }
@@ -824,7 +1014,7 @@ static void try_to_fill_sample(struct sample *sample, const char *name, char *bu
 		return;
 	if (MATCH(".sample.stopdepth", depth, &sample->stopdepth))
 		return;
-	if (MATCH(".sample.cns", get_index, &sample->cns))
+	if (MATCH(".sample.cns", get_cns, &sample->cns))
 		return;
 	if (MATCH(".sample.po2", double_to_permil, &sample->po2))
 		return;
@@ -852,10 +1042,9 @@ static const char *country, *city;
 static void divinglog_place(char *place, void *_location)
 {
 	char **location = _location;
-	char buffer[1024], *p;
-	int len;
+	char buffer[1024];
 
-	len = snprintf(buffer, sizeof(buffer),
+	snprintf(buffer, sizeof(buffer),
 		"%s%s%s%s%s",
 		place,
 		city ? ", " : "",
@@ -863,9 +1052,7 @@ static void divinglog_place(char *place, void *_location)
 		country ? ", " : "",
 		country ? country : "");
 
-	p = malloc(len+1);
-	memcpy(p, buffer, len+1);
-	*location = p;
+	*location = (char *) intern_string(buffer);
 
 	city = NULL;
 	country = NULL;
@@ -878,13 +1065,13 @@ static int divinglog_dive_match(struct dive *dive, const char *name, int len, ch
 		MATCH(".divetime", duration, &dive->dc.duration) ||
 		MATCH(".depth", depth, &dive->dc.maxdepth) ||
 		MATCH(".depthavg", depth, &dive->dc.meandepth) ||
-		MATCH(".tanktype", utf8_string, &dive->cylinder[0].type.description) ||
+		MATCH(".tanktype", utf8_intern, &dive->cylinder[0].type.description) ||
 		MATCH(".tanksize", cylindersize, &dive->cylinder[0].type.size) ||
 		MATCH(".presw", pressure, &dive->cylinder[0].type.workingpressure) ||
 		MATCH(".press", pressure, &dive->cylinder[0].start) ||
 		MATCH(".prese", pressure, &dive->cylinder[0].end) ||
 		MATCH(".comments", utf8_string, &dive->notes) ||
-		MATCH(".buddy.names", utf8_string, &dive->buddy) ||
+		MATCH(".buddy.names", utf8_intern, &dive->buddy) ||
 		MATCH(".country.name", utf8_string, &country) ||
 		MATCH(".city.name", utf8_string, &city) ||
 		MATCH(".place.name", divinglog_place, &dive->location) ||
@@ -950,6 +1137,8 @@ static int uddf_dive_match(struct dive *dive, const char *name, int len, char *b
 	return	MATCH(".datetime", uddf_datetime, &dive->when) ||
 		MATCH(".diveduration", duration, &dive->dc.duration) ||
 		MATCH(".greatestdepth", depth, &dive->dc.maxdepth) ||
+		MATCH(".averagedepth", depth, &dive->dc.meandepth) ||
+		MATCH(".lowesttemperature", uddf_lowest_temperature, &dive->dc.watertemp) ||
 		MATCH(".date.year", uddf_year, &dive->when) ||
 		MATCH(".date.month", uddf_mon, &dive->when) ||
 		MATCH(".date.day", uddf_mday, &dive->when) ||
@@ -1092,19 +1281,19 @@ static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
 		return;
 	if (MATCH(".lon", gps_long, dive))
 		return;
-	if (MATCH(".location", utf8_string, &dive->location))
+	if (MATCH(".location", utf8_intern, &dive->location))
 		return;
-	if (MATCH("dive.name", utf8_string, &dive->location))
+	if (MATCH("dive.name", utf8_intern, &dive->location))
 		return;
-	if (MATCH(".suit", utf8_string, &dive->suit))
+	if (MATCH(".suit", utf8_intern, &dive->suit))
 		return;
-	if (MATCH(".divesuit", utf8_string, &dive->suit))
+	if (MATCH(".divesuit", utf8_intern, &dive->suit))
 		return;
 	if (MATCH(".notes", utf8_string, &dive->notes))
 		return;
-	if (MATCH(".divemaster", utf8_string, &dive->divemaster))
+	if (MATCH(".divemaster", utf8_intern, &dive->divemaster))
 		return;
-	if (MATCH(".buddy", utf8_string, &dive->buddy))
+	if (MATCH(".buddy", utf8_intern, &dive->buddy))
 		return;
 	if (MATCH("dive.rating", get_rating, &dive->rating))
 		return;
@@ -1114,13 +1303,13 @@ static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
 		return;
 	if (MATCH(".cylinder.workpressure", pressure, &dive->cylinder[cur_cylinder_index].type.workingpressure))
 		return;
-	if (MATCH(".cylinder.description", utf8_string, &dive->cylinder[cur_cylinder_index].type.description))
+	if (MATCH(".cylinder.description", utf8_intern, &dive->cylinder[cur_cylinder_index].type.description))
 		return;
 	if (MATCH(".cylinder.start", pressure, &dive->cylinder[cur_cylinder_index].start))
 		return;
 	if (MATCH(".cylinder.end", pressure, &dive->cylinder[cur_cylinder_index].end))
 		return;
-	if (MATCH(".weightsystem.description", utf8_string, &dive->weightsystem[cur_ws_index].description))
+	if (MATCH(".weightsystem.description", utf8_intern, &dive->weightsystem[cur_ws_index].description))
 		return;
 	if (MATCH(".weightsystem.weight", weight, &dive->weightsystem[cur_ws_index].weight))
 		return;
@@ -1153,7 +1342,7 @@ static void try_to_fill_trip(dive_trip_t **dive_trip_p, const char *name, char *
 		return;
 	if (MATCH(".time", divetime, &dive_trip->when))
 		return;
-	if (MATCH(".location", utf8_string, &dive_trip->location))
+	if (MATCH(".location", utf8_intern, &dive_trip->location))
 		return;
 	if (MATCH(".notes", utf8_string, &dive_trip->notes))
 		return;
@@ -1183,6 +1372,7 @@ static void reset_dc_info(struct divecomputer *dc)
 {
 	lastcns = lastpo2 = lastndl = laststoptime = laststopdepth = lastindeco = 0;
 	lastsensor = lastcylinderindex = 0;
+	lastevent = NULL;
 }
 
 static void reset_dc_settings(void)
@@ -1191,10 +1381,12 @@ static void reset_dc_settings(void)
 	free((void *)cur_settings.dc.nickname);
 	free((void *)cur_settings.dc.serial_nr);
 	free((void *)cur_settings.dc.firmware);
+	free((void *)cur_settings.dc.fingerprint);
 	cur_settings.dc.model = NULL;
 	cur_settings.dc.nickname = NULL;
 	cur_settings.dc.serial_nr = NULL;
 	cur_settings.dc.firmware = NULL;
+	cur_settings.dc.fingerprint = NULL;
 	cur_settings.dc.deviceid = 0;
 }
 
@@ -1225,6 +1417,8 @@ static void dc_settings_end(void)
 			info->firmware = strdup(cur_settings.dc.firmware);
 		if (!info->nickname && cur_settings.dc.nickname)
 			info->nickname = strdup(cur_settings.dc.nickname);
+		if (!info->fingerprint && cur_settings.dc.fingerprint)
+			info->fingerprint = strdup(cur_settings.dc.fingerprint);
 	}
 	reset_dc_settings();
 }
@@ -1246,8 +1440,10 @@ static void dive_end(void)
 {
 	if (!cur_dive)
 		return;
+	if (import_source == UDDF)
+		uddf_dive_end(cur_dive);
 	if (!is_dive())
-		free(cur_dive);
+		free_dive(cur_dive);
 	else
 		record_dive_to_table(cur_dive, target_table);
 	cur_dive = NULL;
@@ -1284,7 +1480,7 @@ static void event_end(void)
 	struct divecomputer *dc = get_dc();
 	if (cur_event.name) {
 		if (strcmp(cur_event.name, "surface") != 0)
-			add_event(dc, cur_event.time.seconds,
+			lastevent = add_event_after(dc, lastevent, cur_event.time.seconds,
 				cur_event.type, cur_event.flags,
 				cur_event.value, cur_event.name);
 		free((void *)cur_event.name);
@@ -1369,6 +1565,8 @@ static void divecomputer_end(void)
 
 static void entry(const char *name, char *buf)
 {
+	if (import_source == UDDF && try_to_fill_uddf(name, buf))
+		return;
 	if (in_settings) {
 		try_to_fill_dc_settings(name, buf);
 		try_to_match_autogroup(name, buf);
@@ -1481,6 +1679,8 @@ static void DivingLog_importer(void)
 static void uddf_importer(void)
 {
 	import_source = UDDF;
+	uddf_reset();
+	cur_cylinder_index = 0;
 	xml_parsing_units = SI_units;
 	xml_parsing_units.pressure = PASCAL;
 	xml_parsing_units.temperature = KELVIN;
@@ -1518,24 +1718,31 @@ static struct nesting {
 	{ NULL, }
 };
 
+static struct nesting *find_nesting(const char *name)
+{
+	struct nesting *rule = nesting;
+
+	do {
+		if (!strcmp(rule->name, name))
+			break;
+		rule++;
+	} while (rule->name);
+	return rule;
+}
+
 static void traverse(xmlNode *root)
 {
 	xmlNode *n;
 
 	for (n = root; n; n = n->next) {
-		struct nesting *rule = nesting;
+		struct nesting *rule;
 
 		if (!n->name) {
 			visit(n);
 			continue;
 		}
 
-		do {
-			if (!strcmp(rule->name, n->name))
-				break;
-			rule++;
-		} while (rule->name);
-
+		rule = find_nesting(n->name);
 		if (rule->start)
 			rule->start();
 		visit(n);
@@ -1558,66 +1765,461 @@ static void reset_all(void)
 	import_source = UNKNOWN;
 }
 
-/* divelog.de sends us xml files that claim to be iso-8859-1
- * but once we decode the HTML encoded characters they turn
- * into UTF-8 instead. So skip the incorrect encoding
- * declaration and decode the HTML encoded characters */
-const char *preprocess_divelog_de(const char *buffer)
+/*
+ * The same walk as traverse(), but straight from the parser, without
+ * building the document first. The nesting rules and entry() see the
+ * same elements, attributes and names in the same order.
+ */
+#define MAXDEPTH 64
+#define MAXPATH 1024
+
+struct reader_state {
+	struct nesting *rule[MAXDEPTH];
+	int pathlen[MAXDEPTH];
+	int depth;
+	char path[MAXPATH];
+	int len;
+};
+
+/* the name of the current node, as nodename() would give it */
+static int append_name(struct reader_state *state, const char *name)
 {
-	char *ret = strstr(buffer, "<DIVELOGSDATA>");
+	int len = state->len;
 
-	if (ret) {
-		xmlParserCtxtPtr ctx;
-		char buf[] = "";
-		int i;
+	if (len && len < MAXPATH - 1)
+		state->path[len++] = '.';
+	while (*name && len < MAXPATH - 1)
+		state->path[len++] = tolower((unsigned char) *name++);
+	state->path[len] = 0;
+	return len;
+}
 
-		for (i = 0; i < strlen(ret); ++i)
-			if (!isascii(ret[i]))
-				return buffer;
+/* like visit_one_node(), which skips the blank text nodes */
+static void reader_entry(struct reader_state *state, int len, char *content)
+{
+	const char *name = state->path + MAX(len - (MAXNAME - 1), 0);
+	const char *p;
+
+	if (!content)
+		return;
+	for (p = content; *p; p++) {
+		if (!IS_BLANK_CH(*p)) {
+			entry(name, content);
+			return;
+		}
+	}
+}
 
-		ctx = xmlCreateMemoryParserCtxt(buf, sizeof(buf));
-		ret = xmlStringLenDecodeEntities(ctx, ret, strlen(ret),  XML_SUBSTITUTE_REF, 0, 0, 0);
+static void reader_leave(struct reader_state *state)
+{
+	struct nesting *rule;
 
-		return ret;
+	if (!state->depth)
+		return;
+	rule = state->rule[--state->depth];
+	state->len = state->pathlen[state->depth];
+	state->path[state->len] = 0;
+	if (rule->end)
+		rule->end();
+}
+
+static int reader_element(xmlTextReaderPtr reader, struct reader_state *state)
+{
+	const char *name = xmlTextReaderConstLocalName(reader);
+	struct nesting *rule = find_nesting(name);
+	int empty = xmlTextReaderIsEmptyElement(reader);
+
+	if (state->depth == MAXDEPTH)
+		return -1;
+	state->rule[state->depth] = rule;
+	state->pathlen[state->depth++] = state->len;
+	state->len = append_name(state, name);
+	if (rule->start)
+		rule->start();
+
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		char *value;
+		int len;
+
+		if (xmlTextReaderIsNamespaceDecl(reader))
+			continue;
+		len = append_name(state, xmlTextReaderConstLocalName(reader));
+		value = xmlTextReaderValue(reader);
+		reader_entry(state, len, value);
+		xmlFree(value);
+		state->path[state->len] = 0;
 	}
-	return buffer;
+	xmlTextReaderMoveToElement(reader);
+
+	if (empty)
+		reader_leave(state);
+	return 0;
 }
 
-void parse_xml_buffer(const char *url, const char *buffer, int size,
-			struct dive_table *table, GError **error)
+static int traverse_reader(xmlTextReaderPtr reader)
 {
-	xmlDoc *doc;
-	const char *res = preprocess_divelog_de(buffer);
+	struct reader_state *state = calloc(1, sizeof(*state));
+	int ret = 1;
 
-	target_table = table;
-	doc = xmlReadMemory(res, strlen(res), url, NULL, 0);
-	if (res != buffer)
-		free((char *)res);
+	if (!state)
+		return -1;
+	do {
+		char *value;
+
+		switch (xmlTextReaderNodeType(reader)) {
+		case XML_READER_TYPE_ELEMENT:
+			if (reader_element(reader, state) < 0)
+				ret = -1;
+			break;
+		case XML_READER_TYPE_END_ELEMENT:
+			reader_leave(state);
+			break;
+		case XML_READER_TYPE_TEXT:
+		case XML_READER_TYPE_CDATA:
+			value = xmlTextReaderValue(reader);
+			reader_entry(state, state->len, value);
+			xmlFree(value);
+			break;
+		}
+	} while (ret > 0 && (ret = xmlTextReaderRead(reader)) == 1);
+
+	while (state->depth)
+		reader_leave(state);
+	free(state);
+	return ret;
+}
+
+/*
+ * The formats we read natively without the whole document in memory,
+ * by the name of the root element. Everything else goes through the
+ * document and, maybe, a stylesheet.
+ */
+static const char *const streamed_roots[] = {
+	"divelog",
+	"uddf",
+	NULL
+};
+
+/*
+ * Like the document parser, which doesn't give us a document at all
+ * when it fails, a broken file doesn't import anything: throw away the
+ * dives (and so their trips) it got into the table so far.
+ */
+static void drop_dives_since(struct dive_table *table, int nr)
+{
+	while (table->nr > nr) {
+		struct dive *dive = table->dives[--table->nr];
+
+		table->dives[table->nr] = NULL;
+		remove_dive_from_trip(dive);
+		free_dive(dive);
+	}
+}
+
+static gboolean parse_xml_stream(const char *url, const char *buffer, int size, GError **error)
+{
+	TRACE_SPAN("parse_xml_stream");
+	xmlTextReaderPtr reader;
+	const char *const *root;
+	const char *name;
+	int nr;
+
+	reader = xmlReaderForMemory(buffer, size, url, NULL, 0);
+	if (!reader)
+		return FALSE;
+	do {
+		if (xmlTextReaderRead(reader) != 1) {
+			xmlFreeTextReader(reader);
+			return FALSE;
+		}
+	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT);
+
+	name = xmlTextReaderConstLocalName(reader);
+	for (root = streamed_roots; *root; root++)
+		if (!strcasecmp(name, *root))
+			break;
+	if (!*root) {
+		xmlFreeTextReader(reader);
+		return FALSE;
+	}
+
+	nr = target_table->nr;
+	reset_all();
+	dive_start();
+	if (traverse_reader(reader) < 0) {
+		dive_end();
+		drop_dives_since(target_table, nr);
+		fprintf(stderr, _("Failed to parse '%s'.\n"), url);
+		parser_error(error, _("Failed to parse '%s'"), url);
+	} else {
+		dive_end();
+	}
+	xmlFreeTextReader(reader);
+	return TRUE;
+}
+
+/* no early exit inside a block, so that the compiler can vectorize it */
+static gboolean is_ascii(const char *p, int len)
+{
+	unsigned char bits = 0;
+	int i;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		for (i = 0; i < 64; i++)
+			bits |= p[i];
+		if (bits & 0x80)
+			return FALSE;
+	}
+	for (i = 0; i < len; i++)
+		bits |= p[i];
+	return !(bits & 0x80);
+}
+
+/*
+ * Decode a character reference "&#252;" or "&#xfc;" at 'p' into 'out';
+ * returns the length of the reference, or 0 if it isn't a valid one.
+ * The UTF-8 is never longer than the reference.
+ */
+static int decode_charref(const char *p, const char *end, char *out, int *outlen)
+{
+	const char *q = p + 2;
+	int base = 10, digits = 0;
+	gunichar c = 0;
+
+	if (q < end && (*q == 'x' || *q == 'X')) {
+		base = 16;
+		q++;
+	}
+	for (; q < end && *q != ';'; q++, digits++) {
+		int v = base == 16 ? g_ascii_xdigit_value(*q) : g_ascii_digit_value(*q);
+
+		if (v < 0 || digits > 7)
+			return 0;
+		c = c * base + v;
+	}
+	if (q == end || !digits || !c || !g_unichar_validate(c))
+		return 0;
+	*outlen = g_unichar_to_utf8(c, out);
+	return q + 1 - p;
+}
+
+/* the entities the XML parser knows about itself */
+static const struct {
+	const char *name;
+	char c;
+} xml_entities[] = {
+	{ "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' }
+};
+
+/*
+ * Decode the entity reference at 'p' into 'out' - inside CDATA, where
+ * the XML parser won't - and drop the named ones the parser doesn't
+ * know. Returns the length of the reference, 0 if it stays as it is.
+ */
+static int decode_entity(const char *p, const char *end, char *out, int *outlen, gboolean cdata)
+{
+	const char *semi;
+	int i;
+
+	*outlen = 0;
+	if (p + 1 < end && p[1] == '#')
+		return cdata ? decode_charref(p, end, out, outlen) : 0;
+
+	for (semi = p + 1; semi < end && g_ascii_isalnum(*semi); semi++)
+		;
+	if (semi == end || *semi != ';' || semi == p + 1)
+		return 0;
+	for (i = 0; i < G_N_ELEMENTS(xml_entities); i++) {
+		if (strlen(xml_entities[i].name) != semi - p - 1 ||
+		    memcmp(xml_entities[i].name, p + 1, semi - p - 1))
+			continue;
+		if (!cdata)
+			return 0;
+		*out = xml_entities[i].c;
+		*outlen = 1;
+		break;
+	}
+	return semi + 1 - p;
+}
+
+/* divelog.de sends us xml files that claim to be iso-8859-1
+ * but once we decode the HTML encoded characters they turn
+ * into UTF-8 instead. So skip the incorrect encoding
+ * declaration and decode the HTML encoded characters.
+ *
+ * Those are in the CDATA sections, everywhere else the XML
+ * parser decodes the references itself. It's a single pass
+ * over the data, which is ASCII and NUL terminated. */
+static const char *preprocess_divelog_de(const char *buffer, int *size)
+{
+	const char *p = strstr(buffer, "<DIVELOGSDATA>"), *end;
+	gboolean cdata = FALSE;
+	char *ret, *out;
+
+	if (!p)
+		return buffer;
+	end = buffer + *size;
+	if (!is_ascii(p, end - p))
+		return buffer;
+	ret = out = malloc(end - p + 1);
+	if (!ret)
+		return buffer;
+
+	while (p < end) {
+		int n = strcspn(p, cdata ? "&]" : "&<");
+		int reflen, len;
+
+		memcpy(out, p, n);
+		out += n;
+		p += n;
+		if (p >= end)
+			break;
+
+		switch (*p) {
+		case '&':
+			reflen = decode_entity(p, end, out, &len, cdata);
+			if (reflen) {
+				out += len;
+				p += reflen;
+				continue;
+			}
+			len = 1;
+			break;
+		case '<':
+			len = 1;
+			if (end - p >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+				len = 9;
+				cdata = TRUE;
+			}
+			break;
+		case ']':
+			len = 1;
+			if (end - p >= 3 && !memcmp(p, "]]>", 3)) {
+				len = 3;
+				cdata = FALSE;
+			}
+			break;
+		default:	/* a NUL in the data */
+			len = 1;
+			break;
+		}
+		memcpy(out, p, len);
+		out += len;
+		p += len;
+	}
+	*out = '\0';
+	*size = out - ret;
+	return ret;
+}
+
+/*
+ * Reading the document and transforming it doesn't touch the parser
+ * state, so several can be loaded in parallel; turning them into dives
+ * with parse_xml_doc() has to happen one at a time.
+ */
+xmlDoc *load_xml_io(const char *url, int (*read)(void *context, char *buf, int len), void *context,
+		    GError **error)
+{
+	TRACE_SPAN("load_xml_io");
+	xmlDoc *doc = xmlReadIO(read, NULL, context, url, NULL, 0);
 
 	if (!doc) {
 		fprintf(stderr, _("Failed to parse '%s'.\n"), url);
 		parser_error(error, _("Failed to parse '%s'"), url);
-		return;
+		return NULL;
 	}
-	reset_all();
-	dive_start();
 #ifdef XSLT
 	doc = test_xslt_transforms(doc, error);
 #endif
+	return doc;
+}
+
+void parse_xml_doc(xmlDoc *doc, struct dive_table *table)
+{
+	TRACE_SPAN("parse_xml_doc");
+
+	if (!doc)
+		return;
+	target_table = table;
+	reset_all();
+	dive_start();
 	traverse(xmlDocGetRootElement(doc));
 	dive_end();
 	xmlFreeDoc(doc);
 }
 
+/*
+ * libxml2 copies a buffer it parses from memory as a whole, but only
+ * keeps a small window of what it reads through a callback.
+ */
+struct xml_memory {
+	const char *p, *end;
+};
+
+static int xml_memory_read(void *_mem, char *buffer, int len)
+{
+	struct xml_memory *mem = _mem;
+
+	len = MIN(len, mem->end - mem->p);
+	memcpy(buffer, mem->p, len);
+	mem->p += len;
+	return len;
+}
+
+void parse_xml_buffer(const char *url, const char *buffer, int size,
+			struct dive_table *table, GError **error)
+{
+	TRACE_SPAN("parse_xml_buffer");
+	struct xml_memory mem;
+	const char *res = preprocess_divelog_de(buffer, &size);
+
+	target_table = table;
+	if (!parse_xml_stream(url, res, size, error)) {
+		mem.p = res;
+		mem.end = res + size;
+		parse_xml_doc(load_xml_io(url, xml_memory_read, &mem, error), table);
+	}
+	if (res != buffer)
+		free((char *)res);
+}
+
+xmlDoc *load_xml_buffer(const char *url, const char *buffer, int size, GError **error)
+{
+	struct xml_memory mem;
+	const char *res = preprocess_divelog_de(buffer, &size);
+	xmlDoc *doc;
+
+	mem.p = res;
+	mem.end = res + size;
+	doc = load_xml_io(url, xml_memory_read, &mem, error);
+	if (res != buffer)
+		free((char *)res);
+	return doc;
+}
+
+/* the document comes in pieces, from 'read' */
+void parse_xml_io(const char *url, int (*read)(void *context, char *buf, int len), void *context,
+		  struct dive_table *table, GError **error)
+{
+	TRACE_SPAN("parse_xml_io");
+
+	parse_xml_doc(load_xml_io(url, read, context, error), table);
+}
+
 #ifdef SQLITE3
-extern int dm4_events(void *handle, int columns, char **data, char **column)
+static gboolean dm4_has(sqlite3_stmt *stmt, int column)
+{
+	return sqlite3_column_type(stmt, column) != SQLITE_NULL;
+}
+
+static void dm4_event(sqlite3_stmt *mark)
 {
 	event_start();
-	if(data[1])
-		cur_event.time.seconds = atoi(data[1]);
+	if (dm4_has(mark, 1))
+		cur_event.time.seconds = sqlite3_column_int(mark, 1);
 
-	if(data[2]) {
-		switch (atoi(data[2])) {
+	if (dm4_has(mark, 2)) {
+		switch (sqlite3_column_int(mark, 2)) {
 			case 1:
 				/* 1 Mandatory Safety Stop */
 				cur_event.name = strdup("safety stop (mandatory)");
@@ -1673,113 +2275,137 @@ extern int dm4_events(void *handle, int columns, char **data, char **column)
 				break;
 			case 258:
 				/* 258 Bookmark */
-				if (data[3]) {
+				if (dm4_has(mark, 3)) {
 					cur_event.name = strdup("heading");
-					cur_event.value = atoi(data[3]);
+					cur_event.value = sqlite3_column_int(mark, 3);
 				} else {
 					cur_event.name = strdup("bookmark");
 				}
 				break;
 			default:
 				cur_event.name = strdup("unknown");
-				cur_event.value = atoi(data[2]);
+				cur_event.value = sqlite3_column_int(mark, 2);
 				break;
 		}
 	}
 	event_end();
+}
 
-	return 0;
+/*
+ * The marks are read in the same DiveId order as the dives, so the
+ * events of all the dives are a single pass over the Mark table, too.
+ */
+struct dm4_marks {
+	sqlite3_stmt *stmt;
+	int diveid_column;
+	int status;		/* SQLITE_ROW while there are marks left */
+};
+
+static void dm4_dive_events(struct dm4_marks *marks, int diveid)
+{
+	while (marks->status == SQLITE_ROW) {
+		int id = sqlite3_column_int(marks->stmt, marks->diveid_column);
+
+		if (id > diveid)
+			break;
+		if (id == diveid)
+			dm4_event(marks->stmt);
+		marks->status = sqlite3_step(marks->stmt);
+	}
 }
 
-extern int dm4_dive(void *param, int columns, char **data, char **column)
+static void dm4_dive(sqlite3_stmt *dive, struct dm4_marks *marks)
 {
-	int i, interval, retval = 0;
-	sqlite3 *handle = (sqlite3 *)param;
-	float *profileBlob;
-	unsigned char *tempBlob;
-	int *pressureBlob;
+	int i, interval;
+	const float *profileBlob;
+	const unsigned char *tempBlob;
+	const int *pressureBlob;
+	int profile_samples, temp_samples, pressure_samples;
 	time_t when;
 	struct tm *tm;
-	char *err = NULL;
-	char get_events_template[] = "select * from Mark where DiveId = %d";
-	char get_events[64];
 
 	dive_start();
-	cur_dive->number = atoi(data[0]);
+	cur_dive->number = sqlite3_column_int(dive, 0);
 
 	/* Suunto saves time in 100 nano seconds, we'll need the time in
 	 * seconds.
 	 */
-	when = (time_t)(atol(data[1]) / 10000000);
+	when = (time_t)(sqlite3_column_int64(dive, 1) / 10000000);
 	tm = localtime(&when);
 
 	/* Suunto starts counting time in year 1, we need epoch */
 	tm->tm_year -= 1969;
 	cur_dive->when = mktime(tm);
-	if (data[2])
-		utf8_string(data[2], &cur_dive->notes);
+	if (dm4_has(dive, 2))
+		utf8_string((char *)sqlite3_column_text(dive, 2), &cur_dive->notes);
 
 	/*
 	 * DM4 stores Duration and DiveTime. It looks like DiveTime is
 	 * 10 to 60 seconds shorter than Duration. However, I have no
 	 * idea what is the difference and which one should be used.
-	 * Duration = data[3]
-	 * DiveTime = data[15]
+	 * Duration = column 3
+	 * DiveTime = column 15
 	 */
-	if (data[15])
-		cur_dive->duration.seconds = atoi(data[15]);
+	if (dm4_has(dive, 15))
+		cur_dive->duration.seconds = sqlite3_column_int(dive, 15);
 
 	/*
 	 * TODO: the deviceid hash should be calculated here.
 	 */
 	settings_start();
 	dc_settings_start();
-	if (data[4])
-		utf8_string(data[4], &cur_settings.dc.serial_nr);
-	if (data[5])
-		utf8_string(data[5], &cur_settings.dc.model);
+	if (dm4_has(dive, 4))
+		utf8_string((char *)sqlite3_column_text(dive, 4), &cur_settings.dc.serial_nr);
+	if (dm4_has(dive, 5))
+		utf8_string((char *)sqlite3_column_text(dive, 5), &cur_settings.dc.model);
 
 	cur_settings.dc.deviceid = 0xffffffff;
 	dc_settings_end();
 	settings_end();
 
-	if (data[6])
-		cur_dive->maxdepth.mm = atof(data[6]) * 1000;
-	if (data[8])
-		cur_dive->airtemp.mkelvin = (atoi(data[8]) + 273.15) * 1000;
-	if (data[9])
-		cur_dive->watertemp.mkelvin  = (atoi(data[9]) + 273.15) * 1000;
+	if (dm4_has(dive, 6))
+		cur_dive->maxdepth.mm = sqlite3_column_double(dive, 6) * 1000;
+	if (dm4_has(dive, 8))
+		cur_dive->airtemp.mkelvin = (sqlite3_column_int(dive, 8) + 273.15) * 1000;
+	if (dm4_has(dive, 9))
+		cur_dive->watertemp.mkelvin  = (sqlite3_column_int(dive, 9) + 273.15) * 1000;
 
 	/*
 	 * TODO: handle multiple cylinders
 	 */
 	cylinder_start();
-	if (data[22] && atoi(data[22]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].start.mbar = atoi(data[22]);
-	else if (data[10] && atoi(data[10]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].start.mbar = atoi(data[10]);
-	if (data[23] && atoi(data[23]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].end.mbar = (atoi(data[23]));
-	if (data[11] && atoi(data[11]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].end.mbar = (atoi(data[11]));
-	if (data[12])
-		cur_dive->cylinder[cur_cylinder_index].type.size.mliter = (atof(data[12])) * 1000;
-	if (data[13])
-		cur_dive->cylinder[cur_cylinder_index].type.workingpressure.mbar = (atoi(data[13]));
-	if (data[20])
-		cur_dive->cylinder[cur_cylinder_index].gasmix.o2.permille = atoi(data[20]) * 10;
-	if (data[21])
-		cur_dive->cylinder[cur_cylinder_index].gasmix.he.permille = atoi(data[21]) * 10;
+	if (sqlite3_column_int(dive, 22) > 0)
+		cur_dive->cylinder[cur_cylinder_index].start.mbar = sqlite3_column_int(dive, 22);
+	else if (sqlite3_column_int(dive, 10) > 0)
+		cur_dive->cylinder[cur_cylinder_index].start.mbar = sqlite3_column_int(dive, 10);
+	if (sqlite3_column_int(dive, 23) > 0)
+		cur_dive->cylinder[cur_cylinder_index].end.mbar = sqlite3_column_int(dive, 23);
+	if (sqlite3_column_int(dive, 11) > 0)
+		cur_dive->cylinder[cur_cylinder_index].end.mbar = sqlite3_column_int(dive, 11);
+	if (dm4_has(dive, 12))
+		cur_dive->cylinder[cur_cylinder_index].type.size.mliter = sqlite3_column_double(dive, 12) * 1000;
+	if (dm4_has(dive, 13))
+		cur_dive->cylinder[cur_cylinder_index].type.workingpressure.mbar = sqlite3_column_int(dive, 13);
+	if (dm4_has(dive, 20))
+		cur_dive->cylinder[cur_cylinder_index].gasmix.o2.permille = sqlite3_column_int(dive, 20) * 10;
+	if (dm4_has(dive, 21))
+		cur_dive->cylinder[cur_cylinder_index].gasmix.he.permille = sqlite3_column_int(dive, 21) * 10;
 	cylinder_end();
 
-	if (data[14])
-		cur_dive->surface_pressure.mbar = (atoi(data[14]) * 1000);
-
-	interval = data[16] ? atoi(data[16]) : 0;
-	profileBlob = (float *)data[17];
-	tempBlob = (unsigned char *)data[18];
-	pressureBlob = (int *)data[19];
-	for (i=0; interval && i * interval < cur_dive->duration.seconds; i++) {
+	if (dm4_has(dive, 14))
+		cur_dive->surface_pressure.mbar = sqlite3_column_int(dive, 14) * 1000;
+
+	/* the blobs come straight from the database, and we don't read past their end */
+	interval = sqlite3_column_int(dive, 16);
+	profileBlob = sqlite3_column_blob(dive, 17);
+	profile_samples = sqlite3_column_bytes(dive, 17) / sizeof(float);
+	tempBlob = sqlite3_column_blob(dive, 18);
+	temp_samples = sqlite3_column_bytes(dive, 18);
+	pressureBlob = sqlite3_column_blob(dive, 19);
+	pressure_samples = sqlite3_column_bytes(dive, 19) / sizeof(int);
+	for (i = 0; interval > 0 && i * interval < cur_dive->duration.seconds; i++) {
+		if (profileBlob && i >= profile_samples)
+			break;
 		sample_start();
 		cur_sample->time.seconds = i * interval;
 		if (profileBlob)
@@ -1787,34 +2413,25 @@ extern int dm4_dive(void *param, int columns, char **data, char **column)
 		else
 			cur_sample->depth.mm = cur_dive->maxdepth.mm;
 
-		if (tempBlob)
+		if (i < temp_samples)
 			cur_sample->temperature.mkelvin = (tempBlob[i] + 273.15) * 1000;
-		if (data[19] && data[19][0])
-			cur_sample->cylinderpressure.mbar = pressureBlob[i] ;
+		if (i < pressure_samples)
+			cur_sample->cylinderpressure.mbar = pressureBlob[i];
 		sample_end();
 	}
 
-	snprintf(get_events, sizeof(get_events) - 1, get_events_template, cur_dive->number);
-	retval = sqlite3_exec(handle, get_events, &dm4_events, 0, &err);
-	if (retval != SQLITE_OK) {
-		fprintf(stderr, _("Database query get_events failed.\n"));
-		return 1;
-	}
-
+	dm4_dive_events(marks, cur_dive->number);
 	dive_end();
+}
 
-	/*
-	for (i=0; i<columns;++i) {
-		fprintf(stderr, "%s\t", column[i]);
-	}
-	fprintf(stderr, "\n");
-	for (i=0; i<columns;++i) {
-		fprintf(stderr, "%s\t", data[i]);
-	}
-	fprintf(stderr, "\n");
-	//exit(0);
-	*/
-	return SQLITE_OK;
+static int dm4_column(sqlite3_stmt *stmt, const char *name)
+{
+	int i;
+
+	for (i = 0; i < sqlite3_column_count(stmt); i++)
+		if (!strcmp(sqlite3_column_name(stmt, i), name))
+			return i;
+	return -1;
 }
 #endif
 
@@ -1822,12 +2439,15 @@ int parse_dm4_buffer(const char *url, const char *buffer, int size,
 			struct dive_table *table, GError **error)
 {
 #ifdef SQLITE3
+	TRACE_SPAN("parse_dm4_buffer");
 	int retval;
-	char *err = NULL;
 	sqlite3 *handle;
+	sqlite3_stmt *dives = NULL;
+	struct dm4_marks marks = { NULL, };
 	target_table = table;
 
-	char get_dives[] = "select D.DiveId,StartTime,Note,Duration,SourceSerialNumber,Source,MaxDepth,SampleInterval,StartTemperature,BottomTemperature,D.StartPressure,D.EndPressure,Size,CylinderWorkPressure,SurfacePressure,DiveTime,SampleInterval,ProfileBlob,TemperatureBlob,PressureBlob,Oxygen,Helium,MIX.StartPressure,MIX.EndPressure FROM Dive AS D JOIN DiveMixture AS MIX ON D.DiveId=MIX.DiveId";
+	char get_dives[] = "select D.DiveId,StartTime,Note,Duration,SourceSerialNumber,Source,MaxDepth,SampleInterval,StartTemperature,BottomTemperature,D.StartPressure,D.EndPressure,Size,CylinderWorkPressure,SurfacePressure,DiveTime,SampleInterval,ProfileBlob,TemperatureBlob,PressureBlob,Oxygen,Helium,MIX.StartPressure,MIX.EndPressure FROM Dive AS D JOIN DiveMixture AS MIX ON D.DiveId=MIX.DiveId ORDER BY D.DiveId";
+	char get_events[] = "select * from Mark ORDER BY DiveId";
 
 	retval = sqlite3_open(url,&handle);
 
@@ -1836,14 +2456,31 @@ int parse_dm4_buffer(const char *url, const char *buffer, int size,
 		return 1;
 	}
 
-	retval = sqlite3_exec(handle, get_dives, &dm4_dive, handle, &err);
-
-	if (retval != SQLITE_OK) {
+	if (sqlite3_prepare_v2(handle, get_dives, -1, &dives, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(handle, get_events, -1, &marks.stmt, NULL) != SQLITE_OK ||
+	    (marks.diveid_column = dm4_column(marks.stmt, "DiveId")) < 0) {
 		fprintf(stderr, _("Database query failed '%s'.\n"), url);
+		sqlite3_finalize(dives);
+		sqlite3_finalize(marks.stmt);
+		sqlite3_close(handle);
 		return 1;
 	}
 
+	marks.status = sqlite3_step(marks.stmt);
+	while ((retval = sqlite3_step(dives)) == SQLITE_ROW)
+		dm4_dive(dives, &marks);
+
+	if (retval != SQLITE_DONE || (marks.status != SQLITE_ROW && marks.status != SQLITE_DONE)) {
+		fprintf(stderr, _("Database query failed '%s'.\n"), url);
+		retval = 1;
+	} else {
+		retval = 0;
+	}
+
+	sqlite3_finalize(dives);
+	sqlite3_finalize(marks.stmt);
 	sqlite3_close(handle);
+	return retval;
 #endif
 	return 0;
 }
@@ -1855,6 +2492,9 @@ void parse_xml_init(void)
 
 void parse_xml_exit(void)
 {
+#ifdef XSLT
+	free_stylesheets();
+#endif
 	xmlCleanupParser();
 }
 
@@ -1884,7 +2524,18 @@ static xsltStylesheetPtr try_get_stylesheet(const char *path, int len, const cha
 	return ret;
 }
 
-xsltStylesheetPtr get_stylesheet(const char *name)
+/*
+ * Compiling a stylesheet takes much longer than applying it to a
+ * small file, so they are compiled once and kept until we exit.
+ * Don't free what get_stylesheet() returns.
+ */
+static struct stylesheet_cache {
+	char *name;
+	xsltStylesheetPtr xslt;
+	struct stylesheet_cache *next;
+} *stylesheets;
+
+static xsltStylesheetPtr find_stylesheet(const char *name)
 {
 	const char *path, *next;
 
@@ -1910,6 +2561,50 @@ xsltStylesheetPtr get_stylesheet(const char *name)
 	return NULL;
 }
 
+/* compiled stylesheets can be used by several threads at once */
+xsltStylesheetPtr get_stylesheet(const char *name)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct stylesheet_cache *entry;
+	xsltStylesheetPtr xslt;
+
+	pthread_mutex_lock(&lock);
+	for (entry = stylesheets; entry; entry = entry->next)
+		if (!strcmp(entry->name, name))
+			break;
+	if (entry) {
+		xslt = entry->xslt;
+		goto out;
+	}
+
+	/* failures aren't cached, the file may show up later */
+	xslt = find_stylesheet(name);
+	if (!xslt)
+		goto out;
+	entry = malloc(sizeof(*entry));
+	if (entry) {
+		entry->name = strdup(name);
+		entry->xslt = xslt;
+		entry->next = stylesheets;
+		stylesheets = entry;
+	}
+out:
+	pthread_mutex_unlock(&lock);
+	return xslt;
+}
+
+static void free_stylesheets(void)
+{
+	while (stylesheets) {
+		struct stylesheet_cache *entry = stylesheets;
+
+		stylesheets = entry->next;
+		xsltFreeStylesheet(entry->xslt);
+		free(entry->name);
+		free(entry);
+	}
+}
+
 static struct xslt_files {
 	const char *root;
 	const char *file;
@@ -1918,7 +2613,6 @@ static struct xslt_files {
 	{ "JDiveLog", "jdivelog2subsurface.xslt" },
 	{ "dives", "MacDive.xslt" },
 	{ "DIVELOGSDATA", "divelogs.xslt" },
-	{ "uddf", "uddf.xslt" },
 	{ "profile", "udcf.xslt" },
 	{ "Divinglog", "DivingLog.xslt" },
 	{ NULL, }
@@ -1954,7 +2648,6 @@ static xmlDoc *test_xslt_transforms(xmlDoc *doc, GError **error)
 		}
 		transformed = xsltApplyStylesheet(xslt, doc, NULL);
 		xmlFreeDoc(doc);
-		xsltFreeStylesheet(xslt);
 		return transformed;
 	}
 	return doc;
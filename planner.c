@@ -11,6 +11,8 @@
 #include "dive.h"
 #include "divelist.h"
 #include "planner.h"
+#include "intern.h"
+#include "trace.h"
 
 int decostoplevels[] = { 0, 3000, 6000, 9000, 12000, 15000, 18000, 21000, 24000, 27000,
 		     30000, 33000, 36000, 39000, 42000, 45000, 48000, 51000, 54000, 57000,
@@ -49,14 +51,12 @@ void dump_plan(struct diveplan *diveplan)
 
 void get_gas_from_events(struct divecomputer *dc, int time, int *o2, int *he)
 {
-	struct event *event = dc->events;
-	while (event && event->time.seconds <= time) {
-		if (!strcmp(event->name, "gaschange")) {
-			*o2 = 10 * event->value & 0xffff;
-			*he = 10 * event->value >> 16;
-		}
-		event = event->next;
-	}
+	struct gas_cursor gas;
+
+	gas_cursor_init(&gas, dc, *o2, *he);
+	gas_cursor_advance(&gas, time);
+	*o2 = gas.o2;
+	*he = gas.he;
 }
 
 /* simple helper function to compare two permille values with
@@ -98,6 +98,7 @@ double tissue_at_end(struct dive *dive, char **cached_datap, char **error_string
 	int i, j, t0, t1, gasidx, lastdepth;
 	int o2, he;
 	double tissue_tolerance;
+	struct gas_cursor gas;
 	static char buf[200];
 
 	if (!dive)
@@ -114,11 +115,12 @@ double tissue_at_end(struct dive *dive, char **cached_datap, char **error_string
 	psample = sample = dc->sample;
 	lastdepth = t0 = 0;
 	/* we always start with gas 0 (unless an event tells us otherwise) */
-	o2 = dive->cylinder[0].gasmix.o2.permille;
-	he = dive->cylinder[0].gasmix.he.permille;
+	gas_cursor_init(&gas, dc, dive->cylinder[0].gasmix.o2.permille, dive->cylinder[0].gasmix.he.permille);
 	for (i = 0; i < dc->samples; i++, sample++) {
 		t1 = sample->time.seconds;
-		get_gas_from_events(&dive->dc, t0, &o2, &he);
+		gas_cursor_advance(&gas, t0);
+		o2 = gas.o2;
+		he = gas.he;
 		if ((gasidx = get_gasidx(dive, o2, he)) == -1) {
 			snprintf(buf, sizeof(buf),_("Can't find gas %d/%d"), (o2 + 5) / 10, (he + 5) / 10);
 			*error_string_p = buf;
@@ -181,7 +183,7 @@ int add_gas(struct dive *dive, int o2, int he)
 	mix->he.permille = he;
 	/* since air is stored as 0/0 we need to set a name or an air cylinder
 	 * would be seen as unset (by cylinder_nodata()) */
-	cyl->type.description = strdup(_("Cylinder for planning"));
+	cyl->type.description = intern_string(_("Cylinder for planning"));
 	return i;
 }
 
@@ -206,7 +208,7 @@ struct dive *create_dive_from_plan(struct diveplan *diveplan, char **error_strin
 	dive->when = diveplan->when;
 	dive->dc.surface_pressure.mbar = diveplan->surface_pressure;
 	dc = &dive->dc;
-	dc->model = strdup(_("Simulated Dive"));
+	dc->model = intern_string(_("Simulated Dive"));
 	dp = diveplan->dp;
 
 	/* let's start with the gas given on the first segment */
@@ -272,7 +274,7 @@ struct dive *create_dive_from_plan(struct diveplan *diveplan, char **error_strin
 	}
 	if (dc->samples <= 1) {
 		/* not enough there yet to create a dive - most likely the first time is missing */
-		free(dive);
+		dive_free(dive);
 		dive = NULL;
 	}
 #if DEBUG_PLAN & 32
@@ -282,7 +284,7 @@ struct dive *create_dive_from_plan(struct diveplan *diveplan, char **error_strin
 	return dive;
 
 gas_error_exit:
-	free(dive);
+	dive_free(dive);
 	*error_string = _("Too many gas mixes");
 	return NULL;
 }
@@ -585,6 +587,7 @@ static void add_plan_to_notes(struct diveplan *diveplan, struct dive *dive)
 
 void plan(struct diveplan *diveplan, char **cached_datap, struct dive **divep, char **error_string_p)
 {
+	TRACE_SPAN("plan");
 	struct dive *dive;
 	struct sample *sample;
 	int wait_time, o2, he, po2;
@@ -2,11 +2,6 @@
 
 #include "dive.h"
 
-struct units *get_units()
-{
-	return &prefs.units;
-}
-
 static void set_bool_conf(char *name, gboolean value, gboolean def)
 {
 	if (value == def) {
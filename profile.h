@@ -0,0 +1,54 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+typedef enum { STABLE, SLOW, MODERATE, FAST, CRAZY } velocity_t;
+
+struct plot_data {
+	unsigned int in_deco:1;
+	unsigned int cylinderindex;
+	int sec;
+	/* pressure[0] is sensor pressure
+	 * pressure[1] is interpolated pressure */
+	int pressure[2];
+	int temperature;
+	/* Depth info */
+	int depth;
+	int ceiling;
+	int ndl;
+	int stoptime;
+	int stopdepth;
+	int cns;
+	int smoothed;
+	double po2, pn2, phe;
+	double mod, ead, end, eadd;
+	velocity_t velocity;
+	struct plot_data *min[3];
+	struct plot_data *max[3];
+	int avg[3];
+};
+
+#define SENSOR_PR 0
+#define INTERPOLATED_PR 1
+#define SENSOR_PRESSURE(_entry) (_entry)->pressure[SENSOR_PR]
+#define INTERPOLATED_PRESSURE(_entry) (_entry)->pressure[INTERPOLATED_PR]
+#define GET_PRESSURE(_entry) (SENSOR_PRESSURE(_entry) ? : INTERPOLATED_PRESSURE(_entry))
+
+/* Plot info with smoothing, velocity indication
+ * and one-, two- and three-minute minimums and maximums */
+struct plot_info {
+	int nr;
+	int maxtime;
+	int meandepth, maxdepth;
+	int minpressure, maxpressure;
+	int mintemp, maxtemp;
+	double endtempcoord;
+	double maxpp;
+	gboolean has_ndl;
+	struct plot_data *entry;
+};
+
+extern void calculate_max_limits(struct dive *dive, struct divecomputer *dc, struct plot_info *pi);
+extern struct plot_info *create_plot_info(struct dive *dive, struct divecomputer *dc, struct plot_info *pi);
+extern void free_plot_info(struct plot_info *pi);
+
+#endif
@@ -0,0 +1,172 @@
+/* replay.c */
+/* records dive computer downloads and plays them back (see replay.h)
+ *
+ * With "--record=file" every download writes what came from the dive
+ * computer into the file, with "--replay=file" the next downloads read
+ * it back from there instead, at full speed or, with
+ * "--replay-latency=ms", with a delay for every record to make it look
+ * like a slow link. That way the download code can be tested and timed
+ * without the dive computer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "file.h"
+#include "replay.h"
+
+static char *record_filename, *playback_filename;
+static int latency;
+
+static enum replay_mode mode;
+static FILE *record_file;
+static struct memblock playback;
+static const char *next_record;
+
+void set_replay_record(const char *filename)
+{
+	g_free(record_filename);
+	record_filename = g_strdup(filename);
+}
+
+void set_replay_playback(const char *filename)
+{
+	g_free(playback_filename);
+	playback_filename = g_strdup(filename);
+}
+
+void set_replay_latency(int msec)
+{
+	latency = msec > 0 ? msec : 0;
+}
+
+/* every download gets the whole file, so a replay can be repeated */
+enum replay_mode replay_begin(void)
+{
+	mode = REPLAY_OFF;
+	if (playback_filename) {
+		mode = REPLAY_ERROR;
+		if (readfile(playback_filename, &playback) >= 0 && playback.buffer) {
+			next_record = playback.buffer;
+			mode = REPLAY_PLAYBACK;
+		}
+	} else if (record_filename) {
+		mode = REPLAY_ERROR;
+		record_file = g_fopen(record_filename, "w");
+		if (record_file)
+			mode = REPLAY_RECORD;
+	}
+	return mode;
+}
+
+void replay_end(void)
+{
+	if (record_file)
+		fclose(record_file);
+	record_file = NULL;
+	free_memblock(&playback);
+	next_record = NULL;
+	mode = REPLAY_OFF;
+}
+
+enum replay_mode replay_mode(void)
+{
+	return mode;
+}
+
+void replay_write(const char *tag, const void *data, unsigned int size)
+{
+	const unsigned char *p = data;
+	unsigned int i;
+
+	if (mode != REPLAY_RECORD)
+		return;
+	fprintf(record_file, "%s ", tag);
+	for (i = 0; i < size; i++)
+		fprintf(record_file, "%02x", p[i]);
+	putc('\n', record_file);
+}
+
+void replay_printf(const char *tag, const char *fmt, ...)
+{
+	va_list args;
+	char *data;
+
+	if (mode != REPLAY_RECORD)
+		return;
+	va_start(args, fmt);
+	data = g_strdup_vprintf(fmt, args);
+	va_end(args);
+	replay_write(tag, data, strlen(data));
+	g_free(data);
+}
+
+/* the tag is only valid until the next call */
+int replay_next(char **tag, unsigned char **data)
+{
+	static char tagbuf[32];
+	const char *end = (const char *) playback.buffer + playback.size;
+	const char *p = next_record, *hex;
+	int len, size, i;
+
+	if (mode != REPLAY_PLAYBACK)
+		return -1;
+	while (p < end && *p == '\n')
+		p++;
+	if (p >= end)
+		return -1;
+	hex = memchr(p, ' ', end - p);
+	if (!hex || hex - p >= sizeof(tagbuf))
+		return -1;
+	memcpy(tagbuf, p, hex - p);
+	tagbuf[hex - p] = '\0';
+	hex++;
+	for (len = 0; hex + len < end && hex[len] != '\n'; len++)
+		;
+	next_record = hex + len;
+
+	size = len / 2;
+	*data = malloc(size + 1);
+	if (!*data)
+		return -1;
+	for (i = 0; i < size; i++) {
+		int hi = g_ascii_xdigit_value(hex[2 * i]);
+		int lo = g_ascii_xdigit_value(hex[2 * i + 1]);
+
+		if (hi < 0 || lo < 0) {
+			free(*data);
+			*data = NULL;
+			return -1;
+		}
+		(*data)[i] = hi << 4 | lo;
+	}
+	(*data)[size] = '\0';
+	*tag = tagbuf;
+
+	/* the time the dive computer would have needed for this */
+	if (latency)
+		usleep(latency * 1000);
+	return size;
+}
+
+int replay_read(const char *tag, unsigned char **data)
+{
+	const char *record = next_record;
+	char *next;
+	int size = replay_next(&next, data);
+
+	if (size < 0)
+		return -1;
+	/* leave it for whoever wants it */
+	if (strcmp(next, tag)) {
+		free(*data);
+		*data = NULL;
+		next_record = record;
+		return -1;
+	}
+	return size;
+}
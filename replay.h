@@ -0,0 +1,45 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <glib.h>
+
+/*
+ * Record and replay of dive computer downloads.
+ *
+ * While recording, the downloaders write everything they get from the
+ * dive computer into a file; while replaying they read it back from
+ * that file instead of talking to the device. A replay file is a
+ * sequence of records, each a tag and a blob of data, one per line:
+ *
+ *   <tag> <data in hex>
+ *
+ * The downloaders read the records back in the order they wrote them.
+ */
+enum replay_mode {
+	REPLAY_OFF,
+	REPLAY_RECORD,
+	REPLAY_PLAYBACK,
+	REPLAY_ERROR		/* the replay file couldn't be opened */
+};
+
+extern void set_replay_record(const char *filename);
+extern void set_replay_playback(const char *filename);
+extern void set_replay_latency(int msec);
+
+/* around each download, the mode stays the same in between */
+extern enum replay_mode replay_begin(void);
+extern void replay_end(void);
+extern enum replay_mode replay_mode(void);
+
+extern void replay_write(const char *tag, const void *data, unsigned int size);
+extern void replay_printf(const char *tag, const char *fmt, ...);
+
+/*
+ * The data of the next record, NUL terminated, which the caller has to
+ * free. Both return -1 at the end of the file, replay_read() also when
+ * the next record isn't a 'tag' one - which it then leaves alone.
+ */
+extern int replay_next(char **tag, unsigned char **data);
+extern int replay_read(const char *tag, unsigned char **data);
+
+#endif
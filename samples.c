@@ -0,0 +1,384 @@
+/* samples.c */
+/*
+ * Packed samples for the dives that aren't displayed.
+ *
+ * Most sample fields hardly change over a dive: the time goes up in
+ * steady steps, and sensor, ndl, stop time and depth, deco state, cns
+ * and po2 are often zero for the whole dive. So a packed dive computer
+ * keeps each field as a column of its own. Every value is stored as a
+ * code: 0 for a zero value, otherwise one more than the zigzag encoded
+ * difference to the last non-zero value of that column. Zero having a
+ * code of its own means that temperatures and pressures that are only
+ * reported every few samples don't break up the runs in between.
+ *
+ * Runs of the same code are stored once. Each run is a varint of the
+ * code shifted up by one, with the low bit set when a varint of the
+ * run length (minus two) follows.
+ *
+ * The columns are decoded in one pass with a sample_reader, which is
+ * how the profile and saving read the samples, or a few of them at a
+ * time into a struct sample_columns, which is how the dive metrics read
+ * them. Code that changes samples calls unpack_samples() first.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dive.h"
+
+/* set with --pack-samples */
+int compress_samples;
+
+struct packed_samples {
+	unsigned int offset[SAMPLE_COLUMNS];	/* where each column starts in data[] */
+	unsigned char data[];
+};
+
+static int get_column(const struct sample *s, int column)
+{
+	switch (column) {
+	case COLUMN_TIME:
+		return s->time.seconds;
+	case COLUMN_DEPTH:
+		return s->depth.mm;
+	case COLUMN_TEMPERATURE:
+		return s->temperature.mkelvin;
+	case COLUMN_PRESSURE:
+		return s->cylinderpressure.mbar;
+	case COLUMN_NDL:
+		return s->ndl.seconds;
+	case COLUMN_STOPTIME:
+		return s->stoptime.seconds;
+	case COLUMN_STOPDEPTH:
+		return s->stopdepth.mm;
+	case COLUMN_CNS:
+		return s->cns;
+	case COLUMN_PO2:
+		return s->po2;
+	case COLUMN_SENSOR:
+		return s->sensor;
+	case COLUMN_IN_DECO:
+		return s->in_deco;
+	}
+	return 0;
+}
+
+static void set_column(struct sample *s, int column, int value)
+{
+	switch (column) {
+	case COLUMN_TIME:
+		s->time.seconds = value;
+		break;
+	case COLUMN_DEPTH:
+		s->depth.mm = value;
+		break;
+	case COLUMN_TEMPERATURE:
+		s->temperature.mkelvin = value;
+		break;
+	case COLUMN_PRESSURE:
+		s->cylinderpressure.mbar = value;
+		break;
+	case COLUMN_NDL:
+		s->ndl.seconds = value;
+		break;
+	case COLUMN_STOPTIME:
+		s->stoptime.seconds = value;
+		break;
+	case COLUMN_STOPDEPTH:
+		s->stopdepth.mm = value;
+		break;
+	case COLUMN_CNS:
+		s->cns = value;
+		break;
+	case COLUMN_PO2:
+		s->po2 = value;
+		break;
+	case COLUMN_SENSOR:
+		s->sensor = value;
+		break;
+	case COLUMN_IN_DECO:
+		s->in_deco = value;
+		break;
+	}
+}
+
+/* the code for 'value', which becomes the last non-zero value if it isn't zero */
+static unsigned long long value_code(int value, int *last)
+{
+	long long delta;
+
+	if (!value)
+		return 0;
+	delta = (long long)value - *last;
+	*last = value;
+	return (((unsigned long long)delta << 1) ^ (delta >> 63)) + 1;
+}
+
+struct pack_buffer {
+	unsigned char *data;
+	size_t len, alloc;
+	gboolean failed;
+};
+
+static void put_varint(struct pack_buffer *buf, unsigned long long value)
+{
+	do {
+		unsigned char byte = value & 0x7f;
+
+		value >>= 7;
+		if (value)
+			byte |= 0x80;
+		if (buf->len >= buf->alloc) {
+			size_t alloc = buf->alloc * 2 + 256;
+			unsigned char *data = realloc(buf->data, alloc);
+
+			if (!data) {
+				buf->failed = TRUE;
+				return;
+			}
+			buf->data = data;
+			buf->alloc = alloc;
+		}
+		buf->data[buf->len++] = byte;
+	} while (value);
+}
+
+static unsigned long long get_varint(const unsigned char **pos)
+{
+	unsigned long long value = 0;
+	int shift = 0;
+	unsigned char byte;
+
+	do {
+		byte = *(*pos)++;
+		value |= (unsigned long long)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return value;
+}
+
+static void pack_column(struct pack_buffer *buf, const struct sample *s, int nr, int column)
+{
+	int i = 0, last = 0;
+
+	while (i < nr) {
+		unsigned long long code = value_code(get_column(s + i, column), &last);
+		int run = 1;
+
+		while (i + run < nr) {
+			int next = last;
+
+			if (value_code(get_column(s + i + run, column), &next) != code)
+				break;
+			last = next;
+			run++;
+		}
+		put_varint(buf, code << 1 | (run > 1));
+		if (run > 1)
+			put_varint(buf, run - 2);
+		i += run;
+	}
+}
+
+static int next_value(struct sample_column *col)
+{
+	long long delta;
+
+	if (!col->run) {
+		unsigned long long code = get_varint(&col->pos);
+
+		col->run = 1;
+		if (code & 1)
+			col->run = get_varint(&col->pos) + 2;
+		col->code = code >> 1;
+	}
+	col->run--;
+	if (!col->code)
+		return 0;
+	delta = (long long)((col->code - 1) >> 1) ^ -(long long)((col->code - 1) & 1);
+	col->last += delta;
+	return col->last;
+}
+
+void start_samples(struct sample_reader *reader, struct divecomputer *dc)
+{
+	int i;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->dc = dc;
+	if (dc->packed) {
+		for (i = 0; i < SAMPLE_COLUMNS; i++)
+			reader->column[i].pos = dc->packed->data + dc->packed->offset[i];
+	}
+}
+
+/* the next sample, or NULL after the last one. Valid until the next call */
+const struct sample *next_sample(struct sample_reader *reader)
+{
+	struct divecomputer *dc = reader->dc;
+	int i;
+
+	if (reader->index >= dc->samples)
+		return NULL;
+	if (!dc->packed)
+		return dc->sample + reader->index++;
+	reader->index++;
+	for (i = 0; i < SAMPLE_COLUMNS; i++)
+		set_column(&reader->sample, i, next_value(reader->column + i));
+	return &reader->sample;
+}
+
+static void set_sample_column(struct sample_columns *cols, int i, int column, int value)
+{
+	switch (column) {
+	case COLUMN_TIME:
+		cols->time[i].seconds = value;
+		break;
+	case COLUMN_DEPTH:
+		cols->depth[i].mm = value;
+		break;
+	case COLUMN_PO2:
+		cols->po2[i] = value;
+		break;
+	case COLUMN_SENSOR:
+		cols->sensor[i] = value;
+		break;
+	}
+}
+
+static void fill_sample_column(struct sample_columns *cols, struct divecomputer *dc, int column)
+{
+	struct sample_column col = { NULL, 0, 0, 0 };
+	int i;
+
+	if (!dc->packed) {
+		for (i = 0; i < cols->nr; i++)
+			set_sample_column(cols, i, column, get_column(dc->sample + i, column));
+		return;
+	}
+	/* each column is packed on its own, so the others are never decoded */
+	col.pos = dc->packed->data + dc->packed->offset[column];
+	for (i = 0; i < cols->nr; i++)
+		set_sample_column(cols, i, column, next_value(&col));
+}
+
+/* the columns in 'which' of the samples of 'dc', see struct sample_columns */
+gboolean get_sample_columns(struct sample_columns *cols, struct divecomputer *dc, unsigned int which)
+{
+	int nr = dc->samples, i;
+	size_t size = 0;
+	char *data;
+
+	memset(cols, 0, sizeof(*cols));
+	which &= 1 << COLUMN_TIME | 1 << COLUMN_DEPTH | 1 << COLUMN_PO2 | 1 << COLUMN_SENSOR;
+	if (which & 1 << COLUMN_TIME)
+		size += nr * sizeof(*cols->time);
+	if (which & 1 << COLUMN_DEPTH)
+		size += nr * sizeof(*cols->depth);
+	if (which & 1 << COLUMN_PO2)
+		size += nr * sizeof(*cols->po2);
+	if (which & 1 << COLUMN_SENSOR)
+		size += nr * sizeof(*cols->sensor);
+	if (!size)
+		return TRUE;
+	data = malloc(size);
+	if (!data)
+		return FALSE;
+	cols->nr = nr;
+	cols->data = data;
+
+	/* the widest columns first, so that they all stay aligned */
+	if (which & 1 << COLUMN_TIME) {
+		cols->time = (duration_t *)data;
+		data += nr * sizeof(*cols->time);
+	}
+	if (which & 1 << COLUMN_DEPTH) {
+		cols->depth = (depth_t *)data;
+		data += nr * sizeof(*cols->depth);
+	}
+	if (which & 1 << COLUMN_PO2) {
+		cols->po2 = (uint16_t *)data;
+		data += nr * sizeof(*cols->po2);
+	}
+	if (which & 1 << COLUMN_SENSOR)
+		cols->sensor = (uint8_t *)data;
+
+	for (i = 0; i < SAMPLE_COLUMNS; i++) {
+		if (which & 1 << i)
+			fill_sample_column(cols, dc, i);
+	}
+	return TRUE;
+}
+
+void free_sample_columns(struct sample_columns *cols)
+{
+	free(cols->data);
+	memset(cols, 0, sizeof(*cols));
+}
+
+/* pack the samples of 'dc', unless that doesn't save any memory */
+void pack_samples(struct divecomputer *dc)
+{
+	struct pack_buffer buf = { NULL, offsetof(struct packed_samples, data), 0, FALSE };
+	unsigned int offset[SAMPLE_COLUMNS];
+	struct packed_samples *packed;
+	int i;
+
+	if (!compress_samples || dc->packed || !dc->samples)
+		return;
+	for (i = 0; i < SAMPLE_COLUMNS && !buf.failed; i++) {
+		offset[i] = buf.len - offsetof(struct packed_samples, data);
+		pack_column(&buf, dc->sample, dc->samples, i);
+	}
+	if (buf.failed || buf.len >= dc->samples * sizeof(struct sample)) {
+		free(buf.data);
+		return;
+	}
+	packed = realloc(buf.data, buf.len);
+	if (!packed)
+		packed = (struct packed_samples *)buf.data;
+	memcpy(packed->offset, offset, sizeof(offset));
+	free_samples(dc);
+	dc->packed = packed;
+}
+
+/* turn packed samples back into an array that can be changed */
+gboolean unpack_samples(struct divecomputer *dc)
+{
+	struct sample_reader reader;
+	const struct sample *s;
+	struct sample *sample;
+	int i = 0;
+
+	if (!dc->packed)
+		return TRUE;
+	sample = malloc(dc->samples * sizeof(*sample));
+	if (!sample)
+		return FALSE;
+	for_each_sample(reader, dc, s)
+		sample[i++] = *s;
+	free(dc->packed);
+	dc->packed = NULL;
+	dc->sample = sample;
+	dc->alloc_samples = dc->samples;
+	return TRUE;
+}
+
+void pack_dive(struct dive *dive)
+{
+	struct divecomputer *dc;
+
+	for_each_dc(dive, dc)
+		pack_samples(dc);
+}
+
+gboolean unpack_dive(struct dive *dive)
+{
+	struct divecomputer *dc;
+
+	for_each_dc(dive, dc) {
+		if (!unpack_samples(dc))
+			return FALSE;
+	}
+	return TRUE;
+}
@@ -7,6 +7,7 @@
 
 #include "dive.h"
 #include "device.h"
+#include "trace.h"
 
 static void show_milli(FILE *f, const char *pre, int value, const char *unit, const char *post)
 {
@@ -325,7 +326,7 @@ static void show_index(FILE *f, int value, const char *pre, const char *post)
 		fprintf(f, " %s%d%s", pre, value, post);
 }
 
-static void save_sample(FILE *f, struct sample *sample, struct sample *old)
+static void save_sample(FILE *f, const struct sample *sample, struct sample *old)
 {
 	fprintf(f, "  <sample time='%u:%02u min'", FRACTION(sample->time.seconds,60));
 	show_milli(f, " depth='", sample->depth.mm, " m", "'");
@@ -419,14 +420,40 @@ static void show_date(FILE *f, timestamp_t when)
 		tm.tm_hour, tm.tm_min, tm.tm_sec);
 }
 
-static void save_samples(FILE *f, int nr, struct sample *s)
+static int saved_samples, total_samples;
+
+/*
+ * With a sample tolerance set, only the samples needed to keep the
+ * depth profile within it are written out; see simplify_samples().
+ * That needs the samples unpacked for a while, otherwise packed ones
+ * are written out as they are decoded.
+ */
+static void save_samples(FILE *f, struct divecomputer *dc)
 {
 	struct sample dummy = { };
-
-	while (--nr >= 0) {
-		save_sample(f, s, &dummy);
-		s++;
+	struct sample_reader reader;
+	const struct sample *sample;
+	int i = 0, nr = dc->samples;
+	gboolean was_packed = dc->packed != NULL;
+	char *keep = NULL;
+
+	if (sample_tolerance > 0 && nr > 2 && unpack_samples(dc)) {
+		keep = malloc(nr);
+		if (keep && simplify_samples(dc, sample_tolerance, keep) < 0) {
+			free(keep);
+			keep = NULL;
+		}
+	}
+	for_each_sample(reader, dc, sample) {
+		if (keep && !keep[i++])
+			continue;
+		save_sample(f, sample, &dummy);
+		saved_samples++;
 	}
+	total_samples += nr;
+	free(keep);
+	if (was_packed)
+		pack_samples(dc);
 }
 
 static void save_dc(FILE *f, struct dive *dive, struct divecomputer *dc)
@@ -449,7 +476,7 @@ static void save_dc(FILE *f, struct dive *dive, struct divecomputer *dc)
 	show_duration(f, dc->surfacetime, "  <surfacetime>", "</surfacetime>\n");
 
 	save_events(f, dc->events);
-	save_samples(f, dc->samples, dc->sample);
+	save_samples(f, dc);
 
 	fprintf(f, "  </divecomputer>\n");
 }
@@ -534,7 +561,7 @@ static void save_one_device(FILE *f, struct device_info *info)
 		firmware = NULL;
 
 	/* Do we have anything interesting about this dive computer to save? */
-	if (!serial_nr && !nickname && !firmware)
+	if (!serial_nr && !nickname && !firmware && !info->fingerprint)
 		return;
 
 	fprintf(f, "<divecomputerid");
@@ -543,6 +570,7 @@ static void save_one_device(FILE *f, struct device_info *info)
 	show_utf8(f, serial_nr, " serial='", "'", 1);
 	show_utf8(f, firmware, " firmware='", "'", 1);
 	show_utf8(f, nickname, " nickname='", "'", 1);
+	show_utf8(f, info->fingerprint, " fingerprint='", "'", 1);
 	fprintf(f, "/>\n");
 }
 
@@ -566,6 +594,7 @@ void save_dives(const char *filename)
 
 void save_dives_logic(const char *filename, const gboolean select_only)
 {
+	TRACE_SPAN("save_dives_logic");
 	int i;
 	struct dive *dive;
 	dive_trip_t *trip;
@@ -588,6 +617,7 @@ void save_dives_logic(const char *filename, const gboolean select_only)
 
 	for (trip = dive_trip_list; trip != NULL; trip = trip->next)
 		trip->index = 0;
+	saved_samples = total_samples = 0;
 
 	/* save the dives */
 	for_each_dive(i, dive) {
@@ -618,4 +648,7 @@ void save_dives_logic(const char *filename, const gboolean select_only)
 	}
 	fprintf(f, "</dives>\n</divelog>\n");
 	fclose(f);
+	if (verbose && sample_tolerance > 0 && saved_samples)
+		fprintf(stderr, "saved %d of %d samples (%.1f:1)\n",
+			saved_samples, total_samples, (double)total_samples / saved_samples);
 }
@@ -0,0 +1,32 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+typedef struct {
+	int period;
+	duration_t total_time;
+	/* avg_time is simply total_time / nr -- let's not keep this */
+	duration_t shortest_time;
+	duration_t longest_time;
+	depth_t max_depth;
+	depth_t min_depth;
+	depth_t avg_depth;
+	volume_t max_sac;
+	volume_t min_sac;
+	volume_t avg_sac;
+	int max_temp;
+	int min_temp;
+	double combined_temp;
+	unsigned int combined_count;
+	unsigned int selection_size;
+	unsigned int total_sac_time;
+} stats_t;
+
+extern stats_t stats;
+extern stats_t stats_selection;
+extern stats_t *stats_monthly;
+extern stats_t *stats_yearly;
+
+extern void process_all_dives(struct dive *dive, struct dive **prev_dive);
+extern void process_selected_dives(void);
+
+#endif
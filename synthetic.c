@@ -0,0 +1,266 @@
+/* synthetic.c */
+/* creates a logbook of made-up dives for benchmarking and scale testing
+ *
+ * The dives are added to the dive table just like imported ones. The
+ * same options and seed always give the same dives, on every platform.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dive.h"
+#include "divelist.h"
+#include "intern.h"
+#include "synthetic.h"
+
+const struct synthetic_options default_synthetic_options = {
+	.dives = 1000,
+	.interval = 10,
+	.divecomputers = 1,
+	.cylinders = 1,
+	.events = 2,
+	.trip_dives = 10,
+	.gps = TRUE,
+	.seed = 1,
+};
+
+#define NR_SITES 100
+
+static struct site {
+	char name[32];
+	int latitude, longitude;	/* micro-degrees */
+} sites[NR_SITES];
+
+static const char *people[] = {
+	"Alice", "Bob", "Carol", "Dave", "Erin", "Frank", "Grace", "Heidi"
+};
+
+/* the libdivecomputer event types and the names we use for them */
+static const struct {
+	int type;
+	const char *name;
+} events[] = {
+	{ 3, "ascent" },
+	{ 4, "ceiling" },
+	{ 8, "bookmark" },
+	{ 12, "safety stop (voluntary)" },
+};
+
+/* simple xorshift generator - rand() differs between C libraries */
+static unsigned int random_state;
+
+static unsigned int random_int(unsigned int max)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return max ? random_state % max : 0;
+}
+
+static void create_sites(void)
+{
+	int i;
+
+	for (i = 0; i < NR_SITES; i++) {
+		snprintf(sites[i].name, sizeof(sites[i].name), "Synthetic site %d", i + 1);
+		sites[i].latitude = (int) random_int(140000000) - 70000000;
+		sites[i].longitude = (int) random_int(360000000) - 180000000;
+	}
+}
+
+/* descend in a minute, ascend in the last five minutes, wobble in between */
+static int profile_depth(int t, int duration, int maxdepth, int wobble)
+{
+	if (t < 60)
+		return maxdepth * t / 60;
+	if (t > duration - 300)
+		return maxdepth * (duration - t) / 300;
+	return maxdepth - wobble;
+}
+
+static void fill_samples(struct divecomputer *dc, struct dive *dive, int interval,
+			 int *switch_time, int cylinders, int noise)
+{
+	int t, duration = dive->dc.duration.seconds;
+	int maxdepth = dive->dc.maxdepth.mm;
+	int temp = dive->watertemp.mkelvin;
+	int wobble = 0;
+
+	for (t = 0; t <= duration; t += interval) {
+		struct sample *sample = prepare_sample(dc);
+		cylinder_t *cyl;
+		int idx = 0, start, end;
+
+		while (idx + 1 < cylinders && t >= switch_time[idx + 1])
+			idx++;
+		cyl = dive->cylinder + idx;
+		start = idx ? switch_time[idx] : 0;
+		end = idx + 1 < cylinders ? switch_time[idx + 1] : duration;
+
+		/* the wobble changes slowly, so the profile looks halfway real */
+		if (!random_int(6))
+			wobble = random_int(maxdepth / 4 + 1);
+		sample->time.seconds = t;
+		sample->depth.mm = profile_depth(t, duration, maxdepth, wobble);
+		if (noise)
+			sample->depth.mm += random_int(2 * noise + 1) - noise;
+		if (sample->depth.mm < 0)
+			sample->depth.mm = 0;
+		sample->temperature.mkelvin = temp + (maxdepth - sample->depth.mm) / 20;
+		sample->sensor = idx;
+		if (end > start)
+			sample->cylinderpressure.mbar = cyl->start.mbar -
+				(long long) (cyl->start.mbar - cyl->end.mbar) * (t - start) / (end - start);
+		finish_sample(dc);
+	}
+}
+
+static struct dive *create_dive(const struct synthetic_options *options, int nr, timestamp_t when)
+{
+	struct dive *dive = alloc_dive();
+	struct divecomputer *dc = &dive->dc, **dcp;
+	struct site *site = sites + random_int(NR_SITES);
+	int switch_time[MAX_CYLINDERS] = { 0, };
+	int duration = 20 * 60 + random_int(50 * 60);
+	int i, cylinders = CLAMP(options->cylinders, 1, MAX_CYLINDERS);
+
+	dive->number = nr;
+	dive->when = dc->when = when;
+	dive->location = (char *) intern_string(site->name);
+	if (options->gps) {
+		dive->latitude.udeg = site->latitude;
+		dive->longitude.udeg = site->longitude;
+	}
+	dive->buddy = (char *) intern_string(people[random_int(G_N_ELEMENTS(people))]);
+	dive->divemaster = (char *) intern_string(people[random_int(G_N_ELEMENTS(people))]);
+	dive->notes = strdup("Synthetic dive");
+	dive->rating = random_int(6);
+	dive->visibility = random_int(6);
+	dive->watertemp.mkelvin = 278000 + random_int(25000);
+	dive->weightsystem[0].weight.grams = 2000 + 500 * random_int(16);
+	dive->weightsystem[0].description = intern_string("integrated");
+
+	/* bottom gas first, then increasingly rich deco gases */
+	for (i = 0; i < cylinders; i++) {
+		cylinder_t *cyl = dive->cylinder + i;
+		int start = 180000 + random_int(50000);
+
+		cyl->type.size.mliter = i ? 7000 : 12000;
+		cyl->type.workingpressure.mbar = 232000;
+		cyl->type.description = intern_string(i ? "7 l" : "12 l");
+		if (i)
+			cyl->gasmix.o2.permille = MIN(1000, 500 + (i - 1) * 250);
+		else
+			cyl->gasmix.o2.permille = random_int(2) ? 320 : 0;
+		cyl->start.mbar = start;
+		cyl->end.mbar = start - 50000 - random_int(100000);
+		/* switch during the ascent */
+		if (i)
+			switch_time[i] = duration - 300 + (i - 1) * 300 / cylinders;
+	}
+
+	dc->model = intern_string("Synthetic");
+	dc->deviceid = 0x5eed0000 + options->seed;
+	dc->diveid = nr;
+	dc->duration.seconds = duration;
+	dc->maxdepth.mm = 5000 + random_int(45000);
+	fill_samples(dc, dive, options->interval, switch_time, cylinders, 0);
+
+	for (i = 1; i < cylinders; i++) {
+		struct gasmix *mix = &dive->cylinder[i].gasmix;
+		int value = (mix->o2.permille + 5) / 10 | ((mix->he.permille + 5) / 10) << 16;
+
+		add_event(dc, switch_time[i], 25, 0, value, "gaschange");
+	}
+	for (i = 0; i < options->events; i++) {
+		int n = random_int(G_N_ELEMENTS(events));
+
+		add_event(dc, random_int(duration), events[n].type, 0, 0, events[n].name);
+	}
+
+	/* the other dive computers have slightly noisy copies of the profile */
+	dcp = &dc->next;
+	for (i = 1; i < options->divecomputers; i++) {
+		struct divecomputer *other = calloc(1, sizeof(*other));
+		char model[32];
+
+		snprintf(model, sizeof(model), "Synthetic %d", i + 1);
+		other->model = intern_string(model);
+		other->deviceid = dc->deviceid + i;
+		other->diveid = nr;
+		other->when = when + random_int(5);
+		other->duration = dc->duration;
+		other->maxdepth = dc->maxdepth;
+		fill_samples(other, dive, options->interval * 2, switch_time, cylinders, 100);
+		*dcp = other;
+		dcp = &other->next;
+	}
+	return dive;
+}
+
+void synthesize_dives(const struct synthetic_options *options)
+{
+	int i;
+	timestamp_t when = 1262336400;	/* 2010-01-01 09:00 */
+	dive_trip_t *trip = NULL;
+
+	random_state = options->seed ? options->seed : 1;
+	create_sites();
+	for (i = 0; i < options->dives; i++) {
+		struct dive *dive;
+		gboolean new_trip = options->trip_dives && !(i % options->trip_dives);
+
+		/* trips are a few weeks apart, the dives of a trip a few hours */
+		if (new_trip)
+			when += (20 + random_int(40)) * 24 * 3600;
+		else
+			when += 2 * 3600 + random_int(18 * 3600);
+		dive = create_dive(options, i + 1, when);
+		when += dive->dc.duration.seconds;
+		record_dive(dive);
+
+		if (!options->trip_dives)
+			continue;
+		if (new_trip)
+			trip = create_and_hookup_trip_from_dive(dive);
+		else
+			add_dive_to_trip(dive, trip);
+	}
+}
+
+/*
+ * The command line options of the tools that create synthetic
+ * logbooks; returns FALSE for options that aren't ours.
+ */
+gboolean parse_synthetic_option(struct synthetic_options *options, char opt, const char *arg)
+{
+	switch (opt) {
+	case 'n':
+		options->dives = atoi(arg);
+		break;
+	case 'i':
+		options->interval = MAX(1, atoi(arg));
+		break;
+	case 'd':
+		options->divecomputers = MAX(1, atoi(arg));
+		break;
+	case 'c':
+		options->cylinders = CLAMP(atoi(arg), 1, MAX_CYLINDERS);
+		break;
+	case 'e':
+		options->events = MAX(0, atoi(arg));
+		break;
+	case 'T':
+		options->trip_dives = MAX(0, atoi(arg));
+		break;
+	case 'g':
+		options->gps = atoi(arg) != 0;
+		break;
+	case 's':
+		options->seed = strtoul(arg, NULL, 0);
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
@@ -0,0 +1,24 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+/* what a synthetic logbook should look like */
+struct synthetic_options {
+	int dives;
+	int interval;		/* seconds between samples */
+	int divecomputers;	/* per dive */
+	int cylinders;		/* per dive, the first one is the bottom gas */
+	int events;		/* per dive, on top of the gas changes */
+	int trip_dives;		/* dives per trip, 0 for no trips */
+	gboolean gps;
+	unsigned int seed;
+};
+
+extern const struct synthetic_options default_synthetic_options;
+
+extern void synthesize_dives(const struct synthetic_options *options);
+extern gboolean parse_synthetic_option(struct synthetic_options *options, char opt, const char *arg);
+
+#define SYNTHETIC_USAGE "[-n dives] [-i interval] [-d divecomputers] [-c cylinders] " \
+			"[-e events] [-T dives-per-trip] [-g 0|1] [-s seed]"
+
+#endif
@@ -96,4 +96,21 @@ timestamp_t utc_mktime(struct tm *tm)
 		tm->tm_hour * 60*60 + tm->tm_min * 60 + tm->tm_sec;
 }
 
+const char *weekday(int wday)
+{
+	static const char wday_array[7][7] = {
+		/*++GETTEXT: these are three letter days - we allow up to six code bytes */
+		N_("Sun"), N_("Mon"), N_("Tue"), N_("Wed"), N_("Thu"), N_("Fri"), N_("Sat")
+	};
+	return _(wday_array[wday]);
+}
 
+const char *monthname(int mon)
+{
+	static const char month_array[12][7] = {
+		/*++GETTEXT: these are three letter months - we allow up to six code bytes*/
+		N_("Jan"), N_("Feb"), N_("Mar"), N_("Apr"), N_("May"), N_("Jun"),
+		N_("Jul"), N_("Aug"), N_("Sep"), N_("Oct"), N_("Nov"), N_("Dec"),
+	};
+	return _(month_array[mon]);
+}
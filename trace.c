@@ -0,0 +1,184 @@
+/* trace.c */
+/* collects the timing spans of TRACE_SPAN() (see trace.h)
+ *
+ * Every span keeps a count, the total and the longest time. With
+ * "--profile" these are printed on exit, longest total first; with
+ * "--trace=file.json" every single span is also recorded and written
+ * out in the Chrome trace event format, for chrome://tracing or
+ * similar viewers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "trace.h"
+
+#ifdef TRACE_SPANS
+static gboolean summary;
+static char *trace_filename;
+
+/* the downloads run in their own thread */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t main_thread;
+static struct trace_span *spans;
+static gint64 trace_epoch;
+
+struct trace_event {
+	const char *name;
+	gint64 start, duration;
+	int thread;
+};
+
+/* a trace of a long session shouldn't eat all memory */
+#define MAX_TRACE_EVENTS 1000000
+
+static struct trace_event *events;
+static int nr_events, allocated_events;
+
+struct trace_scope trace_begin(struct trace_span *span)
+{
+	struct trace_scope scope = { span, g_get_monotonic_time() };
+
+	return scope;
+}
+
+static void record_event(struct trace_span *span, gint64 start, gint64 duration)
+{
+	struct trace_event *event;
+
+	if (nr_events >= allocated_events) {
+		if (allocated_events >= MAX_TRACE_EVENTS)
+			return;
+		allocated_events = allocated_events ? allocated_events * 2 : 1024;
+		events = realloc(events, allocated_events * sizeof(*events));
+		if (!events) {
+			nr_events = allocated_events = 0;
+			return;
+		}
+	}
+	event = events + nr_events++;
+	event->name = span->name;
+	event->start = start - trace_epoch;
+	event->duration = duration;
+	event->thread = pthread_equal(pthread_self(), main_thread) ? 1 : 2;
+}
+
+void trace_end(struct trace_scope *scope)
+{
+	struct trace_span *span = scope->span;
+	gint64 duration = g_get_monotonic_time() - scope->start;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!span->count++) {
+		span->next = spans;
+		spans = span;
+	}
+	span->total += duration;
+	if (duration > span->max)
+		span->max = duration;
+	if (trace_filename)
+		record_event(span, scope->start, duration);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static int sort_by_total(const void *_a, const void *_b)
+{
+	const struct trace_span *a = *(const struct trace_span **) _a;
+	const struct trace_span *b = *(const struct trace_span **) _b;
+
+	if (a->total == b->total)
+		return 0;
+	return a->total > b->total ? -1 : 1;
+}
+
+static void print_summary(void)
+{
+	struct trace_span *span, **sorted;
+	int i, nr = 0;
+
+	for (span = spans; span; span = span->next)
+		nr++;
+	sorted = malloc(nr * sizeof(*sorted));
+	if (!sorted)
+		return;
+	for (i = 0, span = spans; span; span = span->next)
+		sorted[i++] = span;
+	qsort(sorted, nr, sizeof(*sorted), sort_by_total);
+
+	fprintf(stderr, "%-28s %10s %12s %12s %12s\n", "span", "count", "total ms", "avg us", "max us");
+	for (i = 0; i < nr; i++) {
+		span = sorted[i];
+		fprintf(stderr, "%-28s %10lu %12.3f %12.1f %12lld\n",
+			span->name, span->count, span->total / 1000.0,
+			(double) span->total / span->count, (long long) span->max);
+	}
+	free(sorted);
+}
+
+static void write_trace(const char *filename)
+{
+	FILE *f = g_fopen(filename, "w");
+	int i;
+
+	if (!f) {
+		fprintf(stderr, "unable to write trace file %s\n", filename);
+		return;
+	}
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i = 0; i < nr_events; i++) {
+		struct trace_event *event = events + i;
+
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%lld,\"dur\":%lld}%s\n",
+			event->name, event->thread, (long long) event->start,
+			(long long) event->duration,
+			i + 1 < nr_events ? "," : "");
+	}
+	fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(f);
+	if (nr_events >= MAX_TRACE_EVENTS)
+		fprintf(stderr, "trace file %s only has the first %d spans\n", filename, nr_events);
+}
+
+void trace_set_summary(void)
+{
+	summary = TRUE;
+}
+
+void trace_set_output(const char *filename)
+{
+	main_thread = pthread_self();
+	trace_epoch = g_get_monotonic_time();
+	trace_filename = strdup(filename);
+}
+
+void trace_exit(void)
+{
+	if (summary)
+		print_summary();
+	if (trace_filename)
+		write_trace(trace_filename);
+}
+#else
+static void not_compiled_in(void)
+{
+	fprintf(stderr, "Built without timing spans; rebuild with \"make TRACE=1\"\n");
+}
+
+void trace_set_summary(void)
+{
+	not_compiled_in();
+}
+
+void trace_set_output(const char *filename)
+{
+	not_compiled_in();
+}
+
+void trace_exit(void)
+{
+}
+#endif
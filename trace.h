@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Timing spans for the hot paths. Build with "make TRACE=1" to compile
+ * them in; otherwise TRACE_SPAN() is empty and costs nothing.
+ *
+ * A TRACE_SPAN("name") at the top of a function (it is a declaration,
+ * so it goes with the other local variables) times everything until
+ * the function returns, however it returns.
+ */
+#ifdef TRACE_SPANS
+#include <glib.h>
+
+struct trace_span {
+	const char *name;
+	unsigned long count;
+	gint64 total, max;
+	struct trace_span *next;
+};
+
+struct trace_scope {
+	struct trace_span *span;
+	gint64 start;
+};
+
+extern struct trace_scope trace_begin(struct trace_span *span);
+extern void trace_end(struct trace_scope *scope);
+
+#define TRACE_SPAN(name) \
+	static struct trace_span trace_span_ = { name }; \
+	struct trace_scope trace_scope_ __attribute__((cleanup(trace_end))) = trace_begin(&trace_span_)
+#else
+#define TRACE_SPAN(name) struct trace_span_unused_
+#endif
+
+/* "--profile" and "--trace=file.json" on the command line */
+extern void trace_set_summary(void);
+extern void trace_set_output(const char *filename);
+/* print the summary and write the trace file, if they were asked for */
+extern void trace_exit(void);
+
+#endif
@@ -18,16 +18,23 @@
 #include <unistd.h>
 #include <string.h>
 #include <glib/gi18n.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 #include "uemis.h"
 #include "dive.h"
 #include "divelist.h"
 #include "display.h"
 #include "display-gtk.h"
+#include "intern.h"
+#include "replay.h"
 
 #define ERR_FS_ALMOST_FULL N_("Uemis Zurich: File System is almost full\nDisconnect/reconnect the dive computer\nand click \'Retry\'")
 #define ERR_FS_FULL N_("Uemis Zurich: File System is full\nDisconnect/reconnect the dive computer\nand try again")
 #define ERR_FS_SHORT_WRITE N_("Short write to req.txt file\nIs the Uemis Zurich plugged in correctly?")
+#define ERR_REPLAY N_("Uemis Zurich: the download doesn't match the replay file")
 #define BUFLEN 2048
 #define NUM_PARAM_BUFS 10
 
@@ -130,14 +137,14 @@ static void uemis_get_weight(char *buffer, weightsystem_t *weight, int diveid)
 {
 	weight->weight.grams = uemis_get_weight_unit(diveid) ?
 		lbs_to_grams(g_ascii_strtod(buffer, NULL)) : g_ascii_strtod(buffer, NULL) * 1000;
-	weight->description = strdup(_("unknown"));
+	weight->description = intern_string(_("unknown"));
 }
 
 static struct dive *uemis_start_dive(uint32_t deviceid)
 {
 	struct dive *dive = alloc_dive();
 	dive->downloaded = TRUE;
-	dive->dc.model = strdup("Uemis Zurich");
+	dive->dc.model = intern_string("Uemis Zurich");
 	dive->dc.deviceid = deviceid;
 	return dive;
 }
@@ -173,6 +180,99 @@ static int number_of_file(char *path)
 	return count;
 }
 
+/*
+ * Instead of always sleeping for the whole timeout, we watch the ANS
+ * directory and stop waiting as soon as the device has written the
+ * answer. That only works where the kernel sees the device writing
+ * the file; where it doesn't, or without inotify, the wait is the
+ * fixed timeout as before.
+ */
+static int ans_watch = -1;
+
+static void uemis_watch_answers(const char *ans_path)
+{
+#ifdef __linux__
+	ans_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ans_watch >= 0 && inotify_add_watch(ans_watch, ans_path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(ans_watch);
+		ans_watch = -1;
+	}
+#endif
+}
+
+static void uemis_unwatch_answers(void)
+{
+	if (ans_watch >= 0)
+		close(ans_watch);
+	ans_watch = -1;
+}
+
+#ifdef __linux__
+/* has the file been written since we looked last? */
+static gboolean ans_file_written(const char *name)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	gboolean written = FALSE;
+	ssize_t len;
+
+	while ((len = read(ans_watch, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+
+		while (p < buf + len) {
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			/* FAT file systems are often mounted with lower case names */
+			if (event->len && !g_ascii_strcasecmp(event->name, name))
+				written = TRUE;
+			p += sizeof(*event) + event->len;
+		}
+	}
+	return written;
+}
+#endif
+
+/* wait up to 'timeout' microseconds for the device to write ANS file 'nr' */
+static void uemis_wait_for_answer(int nr, int timeout)
+{
+	/* a replay has its own latency */
+	if (replay_mode() == REPLAY_PLAYBACK)
+		return;
+#ifdef __linux__
+	if (ans_watch >= 0) {
+		gint64 end = g_get_monotonic_time() + timeout;
+		char name[13];
+
+		snprintf(name, sizeof(name), "ANS%d.TXT", nr);
+		for (;;) {
+			struct pollfd pfd = { ans_watch, POLLIN, 0 };
+			gint64 left = end - g_get_monotonic_time();
+
+			if (left <= 0 || poll(&pfd, 1, (left + 999) / 1000) <= 0)
+				return;
+			if (ans_file_written(name))
+				return;
+		}
+	}
+#endif
+	usleep(timeout);
+}
+
+/* a replay starts where the recorded download started */
+static gboolean uemis_replay_init(void)
+{
+	unsigned char *data;
+	gboolean ok;
+	int i;
+
+	if (replay_read("uemis", &data) < 0)
+		return FALSE;
+	ok = sscanf((char *)data, "%d %d", &filenr, &number_of_files) == 2;
+	free(data);
+	for (i = 0; i < NUM_PARAM_BUFS; i++)
+		param_buff[i] = "";
+	return ok;
+}
+
 /* Check if there's a req.txt file and get the starting filenr from it.
  * Test for the maximum number of ANS files (I believe this is always
  * 4000 but in case there are differences depending on firmware, this
@@ -182,6 +282,8 @@ static gboolean uemis_init(const char *path)
 	char *ans_path;
 	int i;
 
+	if (replay_mode() == REPLAY_PLAYBACK)
+		return uemis_replay_init();
 	if (!path)
 		return FALSE;
 	/* let's check if this is indeed a Uemis DC */
@@ -214,7 +316,9 @@ static gboolean uemis_init(const char *path)
 	 * ANS files. But with a FAT filesystem that isn't possible */
 	ans_path = g_build_filename(path, "ANS", NULL);
 	number_of_files = number_of_file(ans_path);
+	uemis_watch_answers(ans_path);
 	g_free(ans_path);
+	replay_printf("uemis", "%d %d", filenr, number_of_files);
 	/* initialize the array in which we collect the answers */
 	for (i = 0; i < NUM_PARAM_BUFS; i++)
 		param_buff[i] = "";
@@ -233,10 +337,15 @@ static void str_append_with_delim(char *s, char *t)
  * file (prefixed by 'n' or 'r') and then again at the very end of it, after
  * the full request (this time without the prefix).
  * Then it syncs (not needed on Windows) and closes the file. */
-static void trigger_response(int file, char *command, int nr, long tailpos)
+static void trigger_response(char *command, int nr, long tailpos)
 {
 	char fl[10];
+	int file;
 
+	/* nobody is listening */
+	if (replay_mode() == REPLAY_PLAYBACK)
+		return;
+	file = g_open(reqtxt_path, O_RDWR | O_CREAT, 0666);
 	snprintf(fl, 8, "%s%04d", command, nr);
 #if UEMIS_DEBUG & 4
 	fprintf(debugfile,":tr %s (after seeks)\n", fl);
@@ -251,6 +360,71 @@ static void trigger_response(int file, char *command, int nr, long tailpos)
 	close(file);
 }
 
+/* the request to req.txt, or when replaying, the check that it's the recorded one */
+static gboolean write_request(const char *sb, int length, char **error_text)
+{
+	unsigned char *recorded = NULL;
+	gboolean ok;
+
+	if (replay_mode() == REPLAY_PLAYBACK) {
+		ok = replay_read("req", &recorded) == length && !memcmp(recorded, sb, length);
+		free(recorded);
+		if (!ok)
+			*error_text = _(ERR_REPLAY);
+		return ok;
+	}
+	replay_write("req", sb, length);
+	reqtxt_file = g_open(reqtxt_path, O_RDWR | O_CREAT, 0666);
+	ok = write(reqtxt_file, sb, length) == length;
+	close(reqtxt_file);
+	if (!ok)
+		*error_text = _(ERR_FS_SHORT_WRITE);
+	return ok;
+}
+
+/*
+ * Up to 'max' bytes of an ANS file (all of it for 0), NUL terminated.
+ * A file that isn't there is empty. When replaying, it's the next
+ * record instead - which has to be for the same file, or this returns
+ * NULL.
+ */
+static char *read_ans_file(const char *path, const char *name, int max, int *size)
+{
+	char *ans_path, *buf;
+	int ans_file;
+
+	if (replay_mode() == REPLAY_PLAYBACK) {
+		*size = replay_read(name, (unsigned char **)&buf);
+		if (*size < 0)
+			return NULL;
+		/* a recording that doesn't match this download can hold anything */
+		if (max && *size > max) {
+			*size = max;
+			buf[max] = '\0';
+		}
+		return buf;
+	}
+	ans_path = g_build_filename(path, "ANS", name, NULL);
+	ans_file = g_open(ans_path, O_RDONLY, 0666);
+	*size = ans_file < 0 ? 0 : bytes_available(ans_file);
+	if (max && *size > max)
+		*size = max;
+	buf = malloc(*size + 1);
+	if (*size > 0)
+		*size = read(ans_file, buf, *size);
+	if (*size < 0)
+		*size = 0;
+	buf[*size] = '\0';
+	if (ans_file >= 0)
+		close(ans_file);
+#if UEMIS_DEBUG & 8
+	fprintf(debugfile, "::r %s \"%s\"\n", ans_path, buf);
+#endif
+	g_free(ans_path);
+	replay_write(name, buf, *size);
+	return buf;
+}
+
 static char *next_token(char **buf)
 {
 	char *q, *p = strchr(*buf, '{');
@@ -370,61 +544,79 @@ static void uemis_increased_timeout(int *timeout)
 {
 	if (*timeout < UEMIS_MAX_TIMEOUT)
 		*timeout += UEMIS_LONG_TIMEOUT;
-	usleep(*timeout);
+	uemis_wait_for_answer(filenr - 1, *timeout);
 }
 
-/* send a request to the dive computer and collect the answer */
-static gboolean uemis_get_answer(const char *path, char *request, int n_param_in,
-			int n_param_out, char **error_text)
+/* what we need to know about a request to collect its answer */
+struct uemis_request {
+	char *what;
+	int file_length;
+	int n_param_out;
+	gboolean answer_in_mbuf;
+	gboolean more_files;
+};
+
+/* send a request to the dive computer, without waiting for the answer */
+static gboolean uemis_send_request(char *request, int n_param_in, int n_param_out,
+			struct uemis_request *req, char **error_text)
 {
-	int i = 0, file_length;
+	int i;
 	char sb[BUFLEN];
 	char fl[13];
-	char tmp[101];
-	char *what = _("data");
-	gboolean searching = TRUE;
-	gboolean assembling_mbuf = FALSE;
-	gboolean ismulti = FALSE;
-	gboolean found_answer = FALSE;
-	gboolean more_files = TRUE;
-	gboolean answer_in_mbuf = FALSE;
-	char *ans_path;
-	int ans_file;
-	int timeout = UEMIS_LONG_TIMEOUT;
 
-	reqtxt_file = g_open(reqtxt_path, O_RDWR | O_CREAT, 0666);
+	req->what = _("data");
+	req->n_param_out = n_param_out;
+	req->answer_in_mbuf = FALSE;
+	req->more_files = TRUE;
 	snprintf(sb, BUFLEN, "n%04d12345678", filenr);
 	str_append_with_delim(sb, request);
 	for (i = 0; i < n_param_in; i++)
 		str_append_with_delim(sb, param_buff[i]);
 	if (! strcmp(request, "getDivelogs") || ! strcmp(request, "getDeviceData") || ! strcmp(request, "getDirectory") ||
 		! strcmp(request, "getDivespot") || ! strcmp(request, "getDive")) {
-		answer_in_mbuf = TRUE;
+		req->answer_in_mbuf = TRUE;
 		str_append_with_delim(sb, "");
 		if (! strcmp(request, "getDivelogs"))
-			what = _("divelog entry id");
+			req->what = _("divelog entry id");
 		else if (!strcmp(request, "getDivespot"))
-			what = _("divespot data id");
+			req->what = _("divespot data id");
 		else if (!strcmp(request, "getDive"))
-			what = _("more data dive id");
+			req->what = _("more data dive id");
 	}
 	str_append_with_delim(sb, "");
-	file_length = strlen(sb);
-	snprintf(fl, 10, "%08d", file_length - 13);
+	req->file_length = strlen(sb);
+	snprintf(fl, 10, "%08d", req->file_length - 13);
 	memcpy(sb + 5, fl, strlen(fl));
 #if UEMIS_DEBUG & 1
 	fprintf(debugfile,"::w req.txt \"%s\"\n", sb);
 #endif
-	if (write(reqtxt_file, sb, strlen(sb)) != strlen(sb)) {
-		*error_text = _(ERR_FS_SHORT_WRITE);
+	if (!write_request(sb, req->file_length, error_text))
 		return FALSE;
-	}
 	if (! next_file(number_of_files)) {
 		*error_text = _(ERR_FS_FULL);
-		more_files = FALSE;
+		req->more_files = FALSE;
 	}
-	trigger_response(reqtxt_file, "n", filenr, file_length);
-	usleep(timeout);
+	trigger_response("n", filenr, req->file_length);
+	return TRUE;
+}
+
+/* wait for the answer to the request we sent last and collect it */
+static gboolean uemis_collect_answer(const char *path, struct uemis_request *req, char **error_text)
+{
+	int i;
+	char fl[13];
+	char tmp[101];
+	gboolean searching = TRUE;
+	gboolean assembling_mbuf = FALSE;
+	gboolean ismulti = FALSE;
+	gboolean found_answer = FALSE;
+	gboolean more_files = req->more_files;
+	char *ans;
+	int size;
+	int timeout = UEMIS_LONG_TIMEOUT;
+
+	uemis_wait_for_answer(filenr - 1, timeout);
+	free(mbuf);
 	mbuf = NULL;
 	mbuf_size = 0;
 	while (searching || assembling_mbuf) {
@@ -432,22 +624,16 @@ static gboolean uemis_get_answer(const char *path, char *request, int n_param_in
 			return FALSE;
 		progress_bar_fraction = filenr / 4000.0;
 		snprintf(fl, 13, "ANS%d.TXT", filenr - 1);
-		ans_path = g_build_filename(path, "ANS", fl, NULL);
-		ans_file = g_open(ans_path, O_RDONLY, 0666);
-		read(ans_file, tmp, 100);
-		close(ans_file);
-#if UEMIS_DEBUG & 8
-		tmp[100]='\0';
-		fprintf(debugfile, "::t %s \"%s\"\n", ans_path, tmp);
-#elif UEMIS_DEBUG & 4
-		char pbuf[4];
-		pbuf[0] = tmp[0];
-		pbuf[1] = tmp[1];
-		pbuf[2] = tmp[2];
-		pbuf[3] = 0;
-		fprintf(debugfile, "::t %s \"%s...\"\n", ans_path, pbuf);
+		ans = read_ans_file(path, fl, 100, &size);
+		if (!ans) {
+			*error_text = _(ERR_REPLAY);
+			return FALSE;
+		}
+		memcpy(tmp, ans, size + 1);
+		free(ans);
+#if UEMIS_DEBUG & 4
+		fprintf(debugfile, "::t %s \"%.3s...\"\n", fl, tmp);
 #endif
-		g_free(ans_path);
 		if (tmp[0] == '1') {
 			searching = FALSE;
 			if (tmp[1] == 'm') {
@@ -462,8 +648,7 @@ static gboolean uemis_get_answer(const char *path, char *request, int n_param_in
 					more_files = FALSE;
 					assembling_mbuf = FALSE;
 				}
-				reqtxt_file = g_open(reqtxt_path, O_RDWR | O_CREAT, 0666);
-				trigger_response(reqtxt_file, "n", filenr, file_length);
+				trigger_response("n", filenr, req->file_length);
 			}
 		} else {
 			if (! next_file(number_of_files - 1)) {
@@ -472,73 +657,75 @@ static gboolean uemis_get_answer(const char *path, char *request, int n_param_in
 				assembling_mbuf = FALSE;
 				searching = FALSE;
 			}
-			reqtxt_file = g_open(reqtxt_path, O_RDWR | O_CREAT, 0666);
-			trigger_response(reqtxt_file, "r", filenr, file_length);
+			trigger_response("r", filenr, req->file_length);
 			uemis_increased_timeout(&timeout);
 		}
 		if (ismulti && more_files && tmp[0] == '1') {
-			int size;
 			snprintf(fl, 13, "ANS%d.TXT", assembling_mbuf ? filenr - 2 : filenr - 1);
-			ans_path = g_build_filename(path, "ANS", fl, NULL);
-			ans_file = g_open(ans_path, O_RDONLY, 0666);
-			size = bytes_available(ans_file);
+			ans = read_ans_file(path, fl, 0, &size);
+			if (!ans) {
+				*error_text = _(ERR_REPLAY);
+				return FALSE;
+			}
 			if (size > 3) {
-				char *buf = malloc(size - 2);
-				lseek(ans_file, 3, SEEK_CUR);
-				read(ans_file, buf, size - 3);
-				buf[size - 3] = '\0';
-				buffer_add(&mbuf, &mbuf_size, buf);
-				show_progress(buf, what);
-				free(buf);
+				buffer_add(&mbuf, &mbuf_size, ans + 3);
+				show_progress(ans + 3, req->what);
 				param_buff[3]++;
 			}
-			close(ans_file);
+			free(ans);
 			timeout = UEMIS_TIMEOUT;
-			usleep(UEMIS_TIMEOUT);
+			uemis_wait_for_answer(filenr - 1, UEMIS_TIMEOUT);
 		}
 	}
 	if (more_files) {
-		int size = 0, j = 0;
+		int j = 0;
 		char *buf = NULL;
 
+		ans = NULL;
+		size = 0;
 		if (!ismulti) {
 			snprintf(fl, 13, "ANS%d.TXT", filenr - 1);
-			ans_path = g_build_filename(path, "ANS", fl, NULL);
-			ans_file = g_open(ans_path, O_RDONLY, 0666);
-			size = bytes_available(ans_file);
+			ans = read_ans_file(path, fl, 0, &size);
+			if (!ans) {
+				*error_text = _(ERR_REPLAY);
+				return FALSE;
+			}
 			if (size > 3) {
-				buf = malloc(size - 2);
-				lseek(ans_file, 3, SEEK_CUR);
-				read(ans_file, buf, size - 3);
-				buf[size - 3] = '\0';
+				buf = ans + 3;
 				buffer_add(&mbuf, &mbuf_size, buf);
-				show_progress(buf, what);
-#if UEMIS_DEBUG & 8
-				fprintf(debugfile, "::r %s \"%s\"\n", ans_path, buf);
-#endif
+				show_progress(buf, req->what);
 			}
 			size -= 3;
-			close(ans_file);
-			free(ans_path);
 		} else {
 			ismulti = FALSE;
 		}
 #if UEMIS_DEBUG & 8
 		fprintf(debugfile,":r: %s\n", buf);
 #endif
-		if (!answer_in_mbuf)
-			for (i = 0; i < n_param_out && j < size; i++)
+		if (!req->answer_in_mbuf)
+			for (i = 0; i < req->n_param_out && j < size; i++)
 				param_buff[i] = next_segment(buf, &j, size);
 		found_answer = TRUE;
-		free(buf);
+		free(ans);
 	}
 #if UEMIS_DEBUG & 1
-	for (i = 0; i < n_param_out; i++)
+	for (i = 0; i < req->n_param_out; i++)
 		fprintf(debugfile,"::: %d: %s\n", i, param_buff[i]);
 #endif
 	return found_answer;
 }
 
+/* send a request to the dive computer and collect the answer */
+static gboolean uemis_get_answer(const char *path, char *request, int n_param_in,
+			int n_param_out, char **error_text)
+{
+	struct uemis_request req;
+
+	if (!uemis_send_request(request, n_param_in, n_param_out, &req, error_text))
+		return FALSE;
+	return uemis_collect_answer(path, &req, error_text);
+}
+
 static void parse_divespot(char *buf)
 {
 	char *bp = buf + 1;
@@ -724,7 +911,7 @@ static void process_raw_buffer(uint32_t deviceid, char *inbuf, char **max_divenr
 			record_dive(dive);
 			mark_divelist_changed(TRUE);
 		} else { /* partial dive */
-			free(dive);
+			free_dive(dive);
 		}
 	}
 	free(buf);
@@ -752,6 +939,18 @@ static char *uemis_get_divenr(char *deviceidstr)
 	return strdup(divenr);
 }
 
+/* ask for dive #i, without waiting for the answer */
+static gboolean uemis_request_dive(int i, int object_id, char *objectid,
+			struct uemis_request *req, char **error_text)
+{
+	snprintf(objectid, 10, "%d", object_id);
+	param_buff[2] = objectid;
+#if UEMIS_DEBUG & 2
+	fprintf(debugfile, "getDive %d, object_id %s\n", i, objectid);
+#endif
+	return uemis_send_request("getDive", 3, 0, req, error_text);
+}
+
 static char *do_uemis_download(struct argument_block *args)
 {
 	const char *mountpath = args->mountpath;
@@ -762,7 +961,8 @@ static char *do_uemis_download(struct argument_block *args)
 	char *deviceid = NULL;
 	char *result = NULL;
 	char *endptr;
-	gboolean success, keep_number = FALSE, once = TRUE;
+	gboolean success, pending, keep_number = FALSE, once = TRUE;
+	struct uemis_request req;
 
 	if (dive_table.nr == 0)
 		keep_number = TRUE;
@@ -830,32 +1030,43 @@ static char *do_uemis_download(struct argument_block *args)
 #endif
 	free(newmax);
 	offset = 0;
-	for (i = start; i <= end; i++) {
-		snprintf(objectid, sizeof(objectid), "%d", i + offset);
-		param_buff[2] = objectid;
-#if UEMIS_DEBUG & 2
-		fprintf(debugfile, "getDive %d, object_id %s\n", i, objectid);
-#endif
+	/* while we parse one dive, the dive computer already works on the next one */
+	i = start;
+	pending = i <= end && uemis_request_dive(i, i + offset, objectid, &req, &result);
+	while (pending) {
+		char *divebuf;
+		int divenr = -1;
+
+		success = uemis_collect_answer(mountpath, &req, &result);
+		divebuf = mbuf;
+		mbuf = NULL;
+		pending = FALSE;
+		if (success && !import_thread_cancelled && i < end)
+			pending = uemis_request_dive(i + 1, i + 1 + offset, objectid, &req, &result);
 		/* there is no way I have found to directly get the dive information
 		 * for dive #i as the object_id and logfilenr can be different in the
 		 * getDive call; so we get the first one, compare the actual divenr
 		 * with the one that we wanted, calculate the offset and try again.
 		 * What an insane design... */
-		success = uemis_get_answer(mountpath, "getDive", 3, 0, &result);
-		if (mbuf) {
-			int divenr;
-			process_raw_buffer(deviceidnr, mbuf, &newmax, FALSE, &divenr);
-			if (divenr > -1 && divenr != i) {
-				offset = i - divenr;
+		if (divebuf) {
+			process_raw_buffer(deviceidnr, divebuf, &newmax, FALSE, &divenr);
+			free(divebuf);
+		}
+		if (divenr > -1 && divenr != i) {
+			offset = i - divenr;
 #if UEMIS_DEBUG & 2
-				fprintf(debugfile, "got dive %d -> trying again with offset %d\n", divenr, offset);
+			fprintf(debugfile, "got dive %d -> trying again with offset %d\n", divenr, offset);
 #endif
-				i = start - 1;
-				continue;
-			}
+			/* the dive we asked for in the meantime has the wrong offset, too */
+			if (pending)
+				(void) uemis_collect_answer(mountpath, &req, &result);
+			i = start;
+			pending = uemis_request_dive(i, i + offset, objectid, &req, &result);
+			continue;
 		}
 		if (!success || import_thread_cancelled)
 			break;
+		i++;
 	}
 	success = TRUE;
 	for (i = 0; i <= nr_divespots; i++) {
@@ -884,7 +1095,14 @@ bail:
 static void *pthread_wrapper(void *_data)
 {
 	struct argument_block *args = _data;
-	const char *err_string = do_uemis_download(args);
+	const char *err_string;
+
+	if (replay_begin() == REPLAY_ERROR)
+		err_string = _("Unable to open the replay file");
+	else
+		err_string = do_uemis_download(args);
+	uemis_unwatch_answers();
+	replay_end();
 	import_thread_done = 1;
 	return (void *)err_string;
 }
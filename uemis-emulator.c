@@ -0,0 +1,217 @@
+/* uemis-emulator.c */
+/* a directory that answers like the file system of a Uemis Zurich
+ *
+ * This is for testing the Uemis downloader without the dive computer.
+ * It creates the req.txt file and the ANS directory the downloader
+ * looks for, waits for each request written to req.txt and writes the
+ * answer into the ANS file the request asked for, after the latency
+ * given with -l. Enter the directory as the device of the Uemis Zurich
+ * in the download dialog.
+ *
+ * The dive computer holds -n dives with empty profiles, and there are
+ * no divespots. Once the download ends with terminateSync, the
+ * emulator prints how long the download took from its first request,
+ * so downloads with different builds can be compared, and exits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* the Zurich always has this many */
+#define ANS_FILES 4000
+/* the size of a divelog's file_content */
+#define DIVELOG_SIZE 600
+#define DEVICE_ID 12345
+/* 2013-01-01 10:00 UTC */
+#define FIRST_DIVE 1357034400
+
+static const char *root;
+static int latency = 20, nr_dives = 2;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-l latency-ms] [-n dives] directory\n", name);
+	exit(1);
+}
+
+static char *path_of(const char *name)
+{
+	return g_build_filename(root, name, NULL);
+}
+
+static void write_file(const char *path, const char *content)
+{
+	FILE *f = g_fopen(path, "w");
+
+	if (!f || fputs(content, f) < 0 || fclose(f)) {
+		fprintf(stderr, "can't write %s\n", path);
+		exit(1);
+	}
+}
+
+static void create_device(void)
+{
+	char *ans = path_of("ANS");
+	int i;
+
+	if (g_mkdir_with_parents(ans, 0755)) {
+		fprintf(stderr, "can't create %s\n", ans);
+		exit(1);
+	}
+	/* an answer that isn't there yet starts with '0' */
+	for (i = 0; i < ANS_FILES; i++) {
+		char name[20], *path;
+
+		snprintf(name, sizeof(name), "ANS%d.TXT", i);
+		path = g_build_filename(ans, name, NULL);
+		write_file(path, "0");
+		g_free(path);
+	}
+	g_free(ans);
+	ans = path_of("req.txt");
+	write_file(ans, "");
+	g_free(ans);
+}
+
+/*
+ * The divelogs of all our dives, numbered from 1, a day apart. The
+ * binary part is just the header with the dive and device ids.
+ */
+static void divelogs(GString *answer)
+{
+	int i;
+
+	g_string_append(answer, "{divelog{1.0");
+	for (i = 1; i <= nr_dives; i++) {
+		guchar log[DIVELOG_SIZE] = { 'D', 'i', 'v', 'e', 1, 0, 0 };
+		time_t when = FIRST_DIVE + i * 24 * 3600;
+		char date[32];
+		gchar *content;
+
+		log[7] = i & 0xff;
+		log[8] = i >> 8;
+		log[9] = DEVICE_ID & 0xff;
+		log[10] = DEVICE_ID >> 8;
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&when));
+		content = g_base64_encode(log, sizeof(log));
+		g_string_append_printf(answer, "{object_id{int{%d{date{ts{%s{file_content{bin{%s{",
+				       i, date, content);
+		g_free(content);
+	}
+	g_string_append(answer, "{{");
+}
+
+/* what the device answers to 'request' with the parameters 'param' */
+static GString *answer_for(const char *request, char **param)
+{
+	GString *answer = g_string_new("1  ");
+
+	if (!strcmp(request, "getDeviceId"))
+		g_string_append_printf(answer, "%d{", DEVICE_ID);
+	else if (!strcmp(request, "initSession"))
+		g_string_append(answer, "ok{1{1{1{1{1{");
+	else if (!strcmp(request, "processSync"))
+		g_string_append(answer, "ok{1{");
+	else if (!strcmp(request, "getDivelogs"))
+		divelogs(answer);
+	else if (!strcmp(request, "getDive") && param[0] && param[1] && param[2])
+		/* the object_id of the dive details is the logfilenr */
+		g_string_append_printf(answer, "{dive{1.0{logfilenr{int{%d{{{", atoi(param[2]));
+	else if (!strcmp(request, "terminateSync"))
+		g_string_append(answer, "ok{1{1{");
+	else
+		g_string_append(answer, "{{{");
+	return answer;
+}
+
+/*
+ * A complete request is "n" or "r", the number of the ANS file for
+ * the answer, the length of the request and the request, followed by
+ * the number again.
+ */
+static int complete_request(const char *req, gsize size, int *nr, char **body)
+{
+	int length;
+
+	if (size < 13 || (req[0] != 'n' && req[0] != 'r'))
+		return 0;
+	if (sscanf(req + 1, "%4d", nr) != 1 || sscanf(req + 5, "%8d", &length) != 1)
+		return 0;
+	if (length < 0 || 13 + length + 4 > size || strncmp(req + 13 + length, req + 1, 4))
+		return 0;
+	*body = g_strndup(req + 13, length);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	char *req_path;
+	gint64 start = 0;
+	int i, requests = 0, last = 0;
+
+	for (i = 1; i < argc - 1 && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-l"))
+			latency = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-n"))
+			nr_dives = atoi(argv[i + 1]);
+		else
+			usage(argv[0]);
+	}
+	if (i != argc - 1 || argv[i][0] == '-')
+		usage(argv[0]);
+	root = argv[i];
+	create_device();
+	req_path = path_of("req.txt");
+	printf("waiting for a download from %s\n", root);
+
+	for (;;) {
+		char *req, *body, **param, name[20], *path;
+		gsize size;
+		GString *answer;
+		int nr, complete, done;
+
+		/*
+		 * The downloader writes req.txt in three steps, and every
+		 * request asks for the next ANS file - so look again until
+		 * there is a complete one for a new file.
+		 */
+		if (!g_file_get_contents(req_path, &req, &size, NULL))
+			req = NULL;
+		complete = req && complete_request(req, size, &nr, &body);
+		g_free(req);
+		if (complete && nr <= last)
+			g_free(body);
+		if (!complete || nr <= last) {
+			usleep(1000);
+			continue;
+		}
+		last = nr;
+		if (!requests++)
+			start = g_get_monotonic_time();
+
+		param = g_strsplit(body, "{", 0);
+		answer = answer_for(param[0], param + 1);
+		usleep(latency * 1000);
+		snprintf(name, sizeof(name), "ANS%d.TXT", nr - 1);
+		path = g_build_filename(root, "ANS", name, NULL);
+		write_file(path, answer->str);
+		printf("%s -> %s\n", param[0], name);
+		fflush(stdout);
+
+		done = !strcmp(param[0], "terminateSync");
+		g_free(path);
+		g_string_free(answer, TRUE);
+		g_strfreev(param);
+		g_free(body);
+		if (done)
+			break;
+	}
+	printf("download took %.2fs for %d requests\n",
+	       (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC, requests);
+	g_free(req_path);
+	return 0;
+}
@@ -19,87 +19,116 @@
 
 #include "dive.h"
 #include "uemis.h"
+#include "intern.h"
 #include <libdivecomputer/parser.h>
 #include <libdivecomputer/version.h>
 
 /*
- * following code is based on code found in at base64.sourceforge.net/b64.c
- * AUTHOR:         Bob Trower 08/04/01
- * COPYRIGHT:      Copyright (c) Trantor Standard Systems Inc., 2001
- * NOTE:           This source code may be used as you wish, subject to
- *                 the MIT license.
+ * The value of each base64 character, X for everything else
  */
-/*
- * Translation Table to decode (created by Bob Trower)
- */
-static const char cd64[]="|$$$}rstuvwxyz{$$$$$$$>?@ABCDEFGHIJKLMNOPQRSTUVW$$$$$$XYZ[\\]^_`abcdefghijklmnopq";
+#define X 0xff
+static const uint8_t base64_value[256] = {
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, 62, X, X, X, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, X, X, X, X, X, X,
+	X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, X,
+	X, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
 
 /*
- * decodeblock -- decode 4 '6-bit' characters into 3 8-bit binary bytes
+ * decode a base64 encoded stream discarding padding, line breaks and noise;
+ * returns the number of bytes decoded
+ *
+ * The divelogs are megabytes of plain base64, so this decodes four
+ * characters at a time with a single check that they are all valid,
+ * and only looks at the characters one by one where there is noise.
  */
-static void decodeblock (unsigned char in[4], unsigned char out[3]) {
-	out[0] = (unsigned char) (in[0] << 2 | in[1] >> 4);
-	out[1] = (unsigned char) (in[1] << 4 | in[2] >> 2);
-	out[2] = (unsigned char) (((in[2] << 6) & 0xc0) | in[3]);
-}
+static int decode(const uint8_t *in, uint8_t *out, int len)
+{
+	const uint8_t *end = in + len;
+	uint8_t *start = out;
+	uint32_t bits = 0;
+	int n = 0;
 
-/*
- * decode a base64 encoded stream discarding padding, line breaks and noise
- */
-static void decode(uint8_t *inbuf, uint8_t *outbuf, int inbuf_len) {
-	uint8_t in[4], out[3], v;
-	int i,len,indx_in=0,indx_out=0;
+	for (;;) {
+		while (end - in >= 4) {
+			uint32_t a = base64_value[in[0]], b = base64_value[in[1]];
+			uint32_t c = base64_value[in[2]], d = base64_value[in[3]];
 
-	while (indx_in < inbuf_len) {
-		for (len = 0, i = 0; i < 4 && (indx_in < inbuf_len); i++) {
-			v = 0;
-			while ((indx_in < inbuf_len) && v == 0) {
-				v = inbuf[indx_in++];
-				v = ((v < 43 || v > 122) ? 0 : cd64[ v - 43 ]);
-				if (v)
-					v = ((v == '$') ? 0 : v - 61);
-			}
-			if (indx_in < inbuf_len) {
-				len++;
-				if (v)
-					in[i] = (v - 1);
-			}
-			else
-				in[i] = 0;
+			if ((a | b | c | d) & 0x80)
+				break;
+			bits = a << 18 | b << 12 | c << 6 | d;
+			out[0] = bits >> 16;
+			out[1] = bits >> 8;
+			out[2] = bits;
+			out += 3;
+			in += 4;
 		}
-		if (len) {
-			decodeblock(in, out);
-			for(i = 0; i < len - 1; i++)
-				outbuf[indx_out++] = out[i];
+		/* the slow path, up to the next complete group */
+		n = 0;
+		bits = 0;
+		while (in < end && n < 4) {
+			uint32_t v = base64_value[*in++];
+
+			if (v == 0xff)
+				continue;
+			bits = bits << 6 | v;
+			n++;
 		}
+		if (n < 4)
+			break;
+		out[0] = bits >> 16;
+		out[1] = bits >> 8;
+		out[2] = bits;
+		out += 3;
 	}
+	/* a partial group at the end has n - 1 bytes */
+	bits <<= 6 * (4 - n);
+	if (n > 1)
+		*out++ = bits >> 16;
+	if (n > 2)
+		*out++ = bits >> 8;
+	return out - start;
 }
-/* end code from Bob Trower */
 
 /*
  * convert the base64 data blog
+ *
+ * The buffer is always big enough for the header and one sample, with
+ * zeros after the data, so that a short blob doesn't make us read garbage.
  */
 static int uemis_convert_base64(char *base64, uint8_t **data) {
-	int len,datalen;
+	int len, datalen, size;
 
 	len = strlen(base64);
-	datalen = (len/4 + 1)*3;
+	size = MAX((len / 4 + 1) * 3, 0x123 + 0x25);
+	*data = malloc(size);
+	if (! *data) {
+		fprintf(stderr,"Out of memory\n");
+		return 0;
+	}
+	datalen = decode((uint8_t *)base64, *data, len);
+	memset(*data + datalen, 0, size - datalen);
 	if (datalen < 0x123+0x25) {
 		/* less than header + 1 sample??? */
 		fprintf(stderr,"suspiciously short data block\n");
 	}
-	*data = malloc(datalen);
-	if (! *data) {
-		datalen = 0;
-		fprintf(stderr,"Out of memory\n");
-		goto bail;
-	}
-	decode(base64, *data, len);
 
 	if (memcmp(*data,"Dive\01\00\00",7))
 		fprintf(stderr,"Missing Dive100 header\n");
 
-bail:
 	return datalen;
 }
 
@@ -170,7 +199,7 @@ void uemis_set_divelocation(int divespot, char *text, double longitude, double l
 		return;
 	while (hp) {
 		if (hp->divespot == divespot && hp->location) {
-			*hp->location = strdup(text);
+			*hp->location = (char *) intern_string(text);
 			hp->longitude->udeg = round(longitude * 1000000);
 			hp->latitude->udeg = round(latitude * 1000000);
 		}
@@ -281,12 +310,32 @@ static void uemis_event(struct dive *dive, struct divecomputer *dc, struct sampl
 #endif
 }
 
+/*
+ * the number of samples we want: it seems that a dive_time of 0 indicates
+ * the end of the valid readings; the SDA usually records more samples after
+ * the end of the dive -- we want to discard those, but not cut the dive short;
+ * sadly the dive duration in the header is a) in minutes and b) up to 3 minutes
+ * short
+ */
+static int uemis_count_samples(const uint8_t *data, int datalen, int duration)
+{
+	const uemis_sample_t *u_sample = (const uemis_sample_t *)(data + 0x123);
+	int i, nr = 0;
+
+	for (i = 0x123; i + 0x25 <= datalen; i += 0x25, u_sample++) {
+		if (!u_sample->dive_time || u_sample->dive_time > duration + 180)
+			break;
+		nr++;
+	}
+	return nr;
+}
+
 /*
  * parse uemis base64 data blob into struct dive
  */
 void uemis_parse_divelog_binary(char *base64, void *datap) {
 	int datalen;
-	int i;
+	int i, nr;
 	uint8_t *data;
 	struct sample *sample = NULL;
 	uemis_sample_t *u_sample;
@@ -296,6 +345,8 @@ void uemis_parse_divelog_binary(char *base64, void *datap) {
 	int active = 0;
 
 	datalen = uemis_convert_base64(base64, &data);
+	if (!data)
+		return;
 
 	dive->dc.airtemp.mkelvin = *(uint16_t *)(data + 45) * 100 + ZERO_C_IN_MKELVIN;
 	dive->dc.surface_pressure.mbar = *(uint16_t *)(data + 43);
@@ -305,7 +356,7 @@ void uemis_parse_divelog_binary(char *base64, void *datap) {
 		dive->dc.salinity = FRESHWATER_SALINITY; /* grams per 10l fresh water */
 
 	/* this will allow us to find the last dive read so far from this computer */
-	dc->model = strdup("Uemis Zurich");
+	dc->model = intern_string("Uemis Zurich");
 	dc->deviceid = *(uint32_t *)(data + 9);
 	dc->diveid = *(uint16_t *)(data + 7);
 	/* remember the weight units used in this dive - we may need this later when
@@ -338,16 +389,12 @@ void uemis_parse_divelog_binary(char *base64, void *datap) {
 		dive->cylinder[i].gasmix.o2.permille = *(uint8_t *)(data+120+25*(gasoffset + i)) * 10 + 0.5;
 		dive->cylinder[i].gasmix.he.permille = 0;
 	}
-	/* first byte of divelog data is at offset 0x123 */
-	i = 0x123;
-	u_sample = (uemis_sample_t *)(data + i);
-	while ((i < datalen) && (u_sample->dive_time)) {
-		/* it seems that a dive_time of 0 indicates the end of the valid readings */
-		/* the SDA usually records more samples after the end of the dive --
-		 * we want to discard those, but not cut the dive short; sadly the dive
-		 * duration in the header is a) in minutes and b) up to 3 minutes short */
-		if (u_sample->dive_time > dive->dc.duration.seconds + 180)
-			break;
+	/* first byte of divelog data is at offset 0x123; the samples are parsed
+	 * straight out of the decoded blob, into room made for all of them */
+	nr = uemis_count_samples(data, datalen, dive->dc.duration.seconds);
+	reserve_samples(dc, dc->samples + nr);
+	u_sample = (uemis_sample_t *)(data + 0x123);
+	for (i = 0; i < nr; i++, u_sample++) {
 		if (u_sample->active_tank != active) {
 			active = u_sample->active_tank;
 			add_gas_switch_event(dive, dc, u_sample->dive_time, active);
@@ -362,10 +409,8 @@ void uemis_parse_divelog_binary(char *base64, void *datap) {
 		sample->cns = u_sample->cns;
 		uemis_event(dive, dc, sample, u_sample);
 		finish_sample(dc);
-		i += 0x25;
-		u_sample++;
 	}
 	if (sample)
 		dive->dc.duration.seconds = sample->time.seconds - 1;
-	return;
+	free(data);
 }
@@ -7,6 +7,7 @@
 #include "divelist.h"
 #include "display-gtk.h"
 #include "file.h"
+#include "intern.h"
 
 struct dive_table gps_location_table;
 static gboolean merge_locations_into_dives(void);
@@ -224,7 +225,7 @@ static gboolean merge_locations_into_dives(void)
 					changed++;
 				}
 				if (!dive->location) {
-					dive->location = strdup(gpsfix->location);
+					dive->location = (char *) intern_string(gpsfix->location);
 					changed++;
 				}
 			} else {